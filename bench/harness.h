@@ -0,0 +1,65 @@
+#pragma once
+
+// Timing helpers shared by the benchmarks in this directory. They depend on
+// nothing but the standard library, so each benchmark builds with a single
+// compiler invocation; see the comment at the top of each file.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <initializer_list>
+
+// Keeps the compiler from discarding value or the work that produced it.
+template <typename T>
+inline void keep(const T& value) noexcept {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Nanoseconds per operation of body(state) over ops operations, the best of
+// several runs. setup() builds a fresh state for each run outside the timed
+// region.
+template <typename Setup, typename Body>
+double nsPerOp(size_t ops, Setup setup, Body body, int runs = 5) {
+    double best = 0;
+    for (int run = 0; run < runs; ++run) {
+        auto state = setup();
+        auto start = std::chrono::steady_clock::now();
+        body(state);
+        auto stop = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(stop - start)
+                        .count() /
+                    static_cast<double>(ops);
+        best = run == 0 ? ns : std::min(best, ns);
+    }
+    return best;
+}
+
+template <typename Body>
+double nsPerOp(size_t ops, Body body, int runs = 5) {
+    return nsPerOp(
+        ops, [] { return 0; }, [&](int) { body(); }, runs);
+}
+
+// One row of a table: the name, then one column per value. A negative value
+// prints as "-", for variants that do not apply.
+inline void printRow(const char* name, std::initializer_list<double> values) {
+    std::printf("%-34s", name);
+    for (double value : values) {
+        if (value < 0) {
+            std::printf(" %10s", "-");
+        } else {
+            std::printf(" %10.2f", value);
+        }
+    }
+    std::printf("\n");
+}
+
+inline void printHeader(const char* title,
+                        std::initializer_list<const char*> columns) {
+    std::printf("\n%-34s", title);
+    for (const char* column : columns) {
+        std::printf(" %10s", column);
+    }
+    std::printf("\n");
+}
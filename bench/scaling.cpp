@@ -0,0 +1,232 @@
+// Thread-scaling benchmark for the counting policies: throughput and p99
+// latency of reference-count traffic at 1, 2, 4, ... threads, each thread
+// pinned to its own CPU where the platform allows. From the repository root:
+//
+//   g++ -std=c++20 -O2 -pthread -I. bench/scaling.cpp -o scaling
+//   ./scaling [max_threads]
+//
+// max_threads defaults to 64. The same file is a ThreadSanitizer target;
+// --quick runs every workload briefly at up to four threads:
+//
+//   CXXFLAGS="-std=c++20 -O1 -g -fsanitize=thread -pthread"
+//   g++ $CXXFLAGS -I. bench/scaling.cpp -o scaling_tsan
+//   ./scaling_tsan --quick
+//
+// Throughput is millions of operations per second over all threads. Latency
+// is timed over batches of kBatch operations, and p99 is the 99th percentile
+// of the per-operation time of those batches, in nanoseconds.
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "harness.h"
+#include "smart_pointers.h"
+
+namespace {
+
+constexpr size_t kBatch = 64;
+constexpr size_t kSlots = 1024;
+constexpr size_t kExpireEvery = 16;
+
+size_t ops_per_thread = size_t{1} << 20;
+
+struct Result {
+    double mops;
+    double p99;
+};
+
+void pin(unsigned thread) {
+#if defined(__linux__)
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thread % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)thread;
+#endif
+}
+
+// Runs threads workers, each made by make(thread) on its own thread before
+// the start, then called as work(i) for ops_per_thread values of i.
+template <typename Make>
+Result run(unsigned threads, Make make) {
+    using Clock = std::chrono::steady_clock;
+    size_t batches = ops_per_thread / kBatch;
+    std::vector<std::vector<float>> latencies(threads);
+    std::vector<Clock::time_point> starts(threads);
+    std::vector<Clock::time_point> stops(threads);
+    std::barrier ready(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            pin(t);
+            auto work = make(t);
+            std::vector<float>& samples = latencies[t];
+            samples.reserve(batches);
+            ready.arrive_and_wait();
+            starts[t] = Clock::now();
+            size_t i = 0;
+            for (size_t batch = 0; batch < batches; ++batch) {
+                auto start = Clock::now();
+                for (size_t end = i + kBatch; i < end; ++i) {
+                    work(i);
+                }
+                auto stop = Clock::now();
+                samples.push_back(
+                    std::chrono::duration<float, std::nano>(stop - start)
+                        .count() /
+                    kBatch);
+            }
+            stops[t] = Clock::now();
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<float> all;
+    for (const std::vector<float>& samples : latencies) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    auto p99 = all.begin() + (all.size() * 99) / 100;
+    std::nth_element(all.begin(), p99, all.end());
+    double seconds = std::chrono::duration<double>(
+                         *std::max_element(stops.begin(), stops.end()) -
+                         *std::min_element(starts.begin(), starts.end()))
+                         .count();
+    return {double(threads) * double(batches * kBatch) / seconds / 1e6, *p99};
+}
+
+// Every thread copies and drops the same owner.
+template <typename Policy>
+Result sharedBlock(unsigned threads) {
+    SharedPtr<int, Policy> owner = makeShared<int, Policy>(1);
+    return run(threads, [&](unsigned) {
+        return [&](size_t) {
+            SharedPtr<int, Policy> copy(owner);
+            keep(copy);
+        };
+    });
+}
+
+// Every thread copies and drops an owner of its own.
+template <typename Policy>
+Result privateBlocks(unsigned threads) {
+    return run(threads, [](unsigned) {
+        return [owner = makeShared<int, Policy>(1)](size_t) {
+            SharedPtr<int, Policy> copy(owner);
+            keep(copy);
+        };
+    });
+}
+
+// Every thread owns kSlots objects and locks WeakPtrs to everyone's objects;
+// every kExpireEvery operations it also drops one of its own, so locks race
+// with the last owners going away and turn from hits into misses.
+template <typename Policy>
+Result lockUnderExpiry(unsigned threads) {
+    std::vector<WeakPtr<int, Policy>> weak(threads * kSlots);
+    return run(threads, [&](unsigned thread) {
+        std::vector<SharedPtr<int, Policy>> owners;
+        for (size_t slot = 0; slot < kSlots; ++slot) {
+            owners.push_back(makeShared<int, Policy>(int(slot)));
+            weak[thread * kSlots + slot] = owners.back();
+        }
+        return [&weak, thread,
+                owners = std::move(owners)](size_t i) mutable {
+            SharedPtr<int, Policy> locked =
+                weak[(i * 7919 + thread) % weak.size()].lock();
+            keep(locked);
+            if (i % kExpireEvery == 0) {
+                owners[(i / kExpireEvery) % kSlots].reset();
+            }
+        };
+    });
+}
+
+// One AtomicSharedPtr; one operation in eight is a store, the rest loads.
+Result atomicLoadStore(unsigned threads) {
+    using Value = SharedPtr<int, AtomicPolicy>;
+    AtomicSharedPtr<int> shared(makeShared<int, AtomicPolicy>(0));
+    return run(threads, [&](unsigned thread) {
+        Value mine[2] = {makeShared<int, AtomicPolicy>(int(thread)),
+                         makeShared<int, AtomicPolicy>(-int(thread))};
+        return [&shared, mine](size_t i) {
+            if (i % 8 == 0) {
+                shared.store(mine[(i / 8) % 2]);
+            } else {
+                Value loaded = shared.load();
+                keep(loaded);
+            }
+        };
+    });
+}
+
+void printResults(unsigned threads, std::initializer_list<Result> results) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%u thread%s", threads,
+                  threads == 1 ? "" : "s");
+    std::printf("%-34s", name);
+    for (const Result& result : results) {
+        std::printf(" %10.2f %10.1f", result.mops, result.p99);
+    }
+    std::printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    unsigned max_threads = 64;
+    for (int arg = 1; arg < argc; ++arg) {
+        if (std::strcmp(argv[arg], "--quick") == 0) {
+            ops_per_thread = size_t{1} << 12;
+            max_threads = 4;
+        } else {
+            max_threads = std::max(1, std::atoi(argv[arg]));
+        }
+    }
+
+    using Padded = PaddedPolicy<AtomicPolicy>;
+
+    printHeader("shared block: Mops/s, p99 ns",
+                {"atomic", "p99", "padded", "p99", "biased", "p99"});
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        printResults(threads, {sharedBlock<AtomicPolicy>(threads),
+                               sharedBlock<Padded>(threads),
+                               sharedBlock<BiasedPolicy>(threads)});
+    }
+
+    printHeader("private blocks: Mops/s, p99 ns",
+                {"single", "p99", "atomic", "p99", "biased", "p99"});
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        printResults(threads, {privateBlocks<SingleThreadedPolicy>(threads),
+                               privateBlocks<AtomicPolicy>(threads),
+                               privateBlocks<BiasedPolicy>(threads)});
+    }
+
+    printHeader("lock() under expiry: Mops/s, p99 ns",
+                {"atomic", "p99", "biased", "p99"});
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        printResults(threads, {lockUnderExpiry<AtomicPolicy>(threads),
+                               lockUnderExpiry<BiasedPolicy>(threads)});
+    }
+
+    printHeader("AtomicSharedPtr 1:7 store/load", {"atomic", "p99"});
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        printResults(threads, {atomicLoadStore(threads)});
+    }
+    return 0;
+}
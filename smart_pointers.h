@@ -1,413 +1,2542 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
+
+#include "smart_pointers_fwd.h"
+
+struct SingleThreadedPolicy {
+    using Counter = size_t;
+    using WeakCounter = Counter;
+    static constexpr bool kDeferredRelease = false;
+    static constexpr bool kInstrumented = false;
+    static constexpr bool kTracked = false;
+    static constexpr bool kLazy = false;
+    static constexpr size_t kWeakCounterAlign = alignof(WeakCounter);
+
+    static void increment(Counter& cnt) noexcept {
+        ++cnt;
+    }
+
+    static void add(Counter& cnt, size_t n) noexcept {
+        cnt += n;
+    }
+
+    static bool decrement(Counter& cnt) noexcept {
+        return --cnt == 0;
+    }
+
+    static bool subtract(Counter& cnt, size_t n) noexcept {
+        return (cnt -= n) == 0;
+    }
+
+    static bool incrementIfNonZero(Counter& cnt) noexcept {
+        if (cnt == 0) {
+            return false;
+        }
+        ++cnt;
+        return true;
+    }
+
+    static size_t load(const Counter& cnt) noexcept {
+        return cnt;
+    }
+
+    static size_t loadAcquire(const Counter& cnt) noexcept {
+        return cnt;
+    }
+};
+
+struct AtomicPolicy {
+    using Counter = std::atomic<size_t>;
+    using WeakCounter = Counter;
+    static constexpr bool kDeferredRelease = false;
+    static constexpr bool kInstrumented = false;
+    static constexpr bool kTracked = false;
+    static constexpr bool kLazy = false;
+    static constexpr size_t kWeakCounterAlign = alignof(WeakCounter);
+
+    static void increment(Counter& cnt) noexcept {
+        cnt.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void add(Counter& cnt, size_t n) noexcept {
+        cnt.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    static bool decrement(Counter& cnt) noexcept {
+        return cnt.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    static bool subtract(Counter& cnt, size_t n) noexcept {
+        return cnt.fetch_sub(n, std::memory_order_acq_rel) == n;
+    }
+
+    static bool incrementIfNonZero(Counter& cnt) noexcept {
+        size_t value = cnt.load(std::memory_order_relaxed);
+        do {
+            if (value == 0) {
+                return false;
+            }
+        } while (!cnt.compare_exchange_weak(value, value + 1,
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_relaxed));
+        return true;
+    }
+
+    static size_t load(const Counter& cnt) noexcept {
+        return cnt.load(std::memory_order_relaxed);
+    }
+
+    static size_t loadAcquire(const Counter& cnt) noexcept {
+        return cnt.load(std::memory_order_acquire);
+    }
+};
+
+// Biased reference counting: the thread that creates a block owns its shared
+// count and updates it without locked instructions; other threads use an
+// atomic word. When the owner's count drops to zero it merges the two. If other
+// threads drive their word negative first, the block is queued to the owner,
+// which merges it on its next release, in mergeQueued(), or when it exits;
+// after the owner has exited the queuing thread merges it instead. Weak counts
+// are plain atomics.
+struct BiasedPolicy : AtomicPolicy {
+    struct Counter;
+
+    struct Owner {
+        std::atomic<size_t> refs{1};
+        std::atomic<Counter*> queued{nullptr};
+
+        static Counter* closed() noexcept {
+            return reinterpret_cast<Counter*>(uintptr_t{1});
+        }
+
+        void release() noexcept {
+            if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete this;
+            }
+        }
+    };
+
+    struct Counter {
+        static constexpr uint64_t kZero = uint64_t{1} << 47;
+        static constexpr uint64_t kCountMask = (uint64_t{1} << 48) - 1;
+        static constexpr uint64_t kMerged = uint64_t{1} << 48;
+        static constexpr uint64_t kQueued = uint64_t{1} << 49;
+
+        Owner* owner;
+        std::atomic<uint32_t> biased;
+        std::atomic<uint64_t> shared{kZero};
+        Counter* next_queued = nullptr;
+        void (*dispose)(Counter&) noexcept = nullptr;
+
+        explicit Counter(size_t initial)
+            : owner(localOwner()), biased(static_cast<uint32_t>(initial)) {
+            owner->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        Counter(const Counter&) = delete;
+        ~Counter() {
+            owner->release();
+        }
+    };
+
+    using WeakCounter = AtomicPolicy::Counter;
+    using AtomicPolicy::add;
+    using AtomicPolicy::decrement;
+    using AtomicPolicy::increment;
+    using AtomicPolicy::incrementIfNonZero;
+    using AtomicPolicy::load;
+    using AtomicPolicy::loadAcquire;
+    using AtomicPolicy::subtract;
+
+  private:
+    struct OwnerHandle {
+        ~OwnerHandle() {
+            if (current != nullptr) {
+                mergeList(current->queued.exchange(Owner::closed(),
+                                                   std::memory_order_acq_rel));
+                current->release();
+                current = nullptr;
+            }
+        }
+    };
+
+    static inline thread_local constinit Owner* current = nullptr;
+
+    static Owner* localOwner() {
+        if (current == nullptr) {
+            thread_local OwnerHandle handle;
+            current = new Owner;
+        }
+        return current;
+    }
+
+    static int64_t value(uint64_t word) noexcept {
+        return static_cast<int64_t>(word & Counter::kCountMask) -
+               static_cast<int64_t>(Counter::kZero);
+    }
+
+    static bool owns(const Counter& cnt) noexcept {
+        return cnt.owner == current &&
+               (cnt.shared.load(std::memory_order_relaxed) &
+                Counter::kMerged) == 0;
+    }
+
+    // Folds the biased count into the shared word and takes the block off
+    // the owner's queue. Called by the owner, or by anyone once it exited.
+    static void merge(Counter& cnt) noexcept {
+        uint64_t biased = cnt.biased.load(std::memory_order_relaxed);
+        cnt.biased.store(0, std::memory_order_relaxed);
+        uint64_t word = cnt.shared.load(std::memory_order_relaxed);
+        uint64_t merged;
+        do {
+            merged = ((word + biased) | Counter::kMerged) & ~Counter::kQueued;
+        } while (!cnt.shared.compare_exchange_weak(word, merged,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed));
+        if (value(merged) == 0) {
+            cnt.dispose(cnt);
+        }
+    }
+
+    static void mergeList(Counter* head) noexcept {
+        while (head != nullptr) {
+            Counter* next = head->next_queued;
+            merge(*head);
+            head = next;
+        }
+    }
+
+    static void enqueue(Counter& cnt) noexcept {
+        Counter* top = cnt.owner->queued.load(std::memory_order_relaxed);
+        do {
+            if (top == Owner::closed()) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                merge(cnt);
+                return;
+            }
+            cnt.next_queued = top;
+        } while (!cnt.owner->queued.compare_exchange_weak(
+            top, &cnt, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    static bool dead(uint64_t word) noexcept {
+        return value(word) == 0 && (word & Counter::kQueued) == 0;
+    }
+
+  public:
+    static void increment(Counter& cnt) noexcept {
+        add(cnt, 1);
+    }
+
+    static void add(Counter& cnt, size_t n) noexcept {
+        if (owns(cnt)) {
+            cnt.biased.store(cnt.biased.load(std::memory_order_relaxed) +
+                                 static_cast<uint32_t>(n),
+                             std::memory_order_relaxed);
+        } else {
+            cnt.shared.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    static bool decrement(Counter& cnt) noexcept {
+        return subtract(cnt, 1);
+    }
+
+    // The owner takes as much of n as it can from its biased count and
+    // merges once that is exhausted; the remainder goes to the shared word.
+    static bool subtract(Counter& cnt, size_t n) noexcept {
+        mergeQueued();
+        if (owns(cnt)) {
+            uint32_t biased = cnt.biased.load(std::memory_order_relaxed);
+            if (n < biased) {
+                cnt.biased.store(biased - static_cast<uint32_t>(n),
+                                 std::memory_order_relaxed);
+                return false;
+            }
+            cnt.biased.store(0, std::memory_order_relaxed);
+            uint64_t rest = n - biased;
+            uint64_t word = cnt.shared.load(std::memory_order_relaxed);
+            uint64_t merged;
+            do {
+                merged = (word - rest) | Counter::kMerged;
+            } while (!cnt.shared.compare_exchange_weak(
+                word, merged, std::memory_order_acq_rel,
+                std::memory_order_relaxed));
+            mergeQueued();
+            return dead(merged);
+        }
+        uint64_t word = cnt.shared.fetch_sub(n, std::memory_order_acq_rel) - n;
+        while ((word & Counter::kMerged) == 0) {
+            if (value(word) >= 0 || (word & Counter::kQueued) != 0) {
+                return false;
+            }
+            if (cnt.shared.compare_exchange_weak(word, word | Counter::kQueued,
+                                                 std::memory_order_acq_rel)) {
+                enqueue(cnt);
+                return false;
+            }
+        }
+        return dead(word);
+    }
+
+    static bool incrementIfNonZero(Counter& cnt) noexcept {
+        if (owns(cnt)) {
+            increment(cnt);
+            return true;
+        }
+        uint64_t word = cnt.shared.load(std::memory_order_relaxed);
+        do {
+            int64_t total = value(word);
+            if ((word & Counter::kMerged) == 0) {
+                total += cnt.biased.load(std::memory_order_relaxed);
+            }
+            if (total <= 0) {
+                return false;
+            }
+        } while (!cnt.shared.compare_exchange_weak(word, word + 1,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed));
+        return true;
+    }
+
+    static size_t load(const Counter& cnt) noexcept {
+        int64_t total = value(cnt.shared.load(std::memory_order_relaxed)) +
+                        cnt.biased.load(std::memory_order_relaxed);
+        return total > 0 ? static_cast<size_t>(total) : 0;
+    }
+
+    static size_t loadAcquire(const Counter& cnt) noexcept {
+        int64_t total = value(cnt.shared.load(std::memory_order_acquire)) +
+                        cnt.biased.load(std::memory_order_relaxed);
+        return total > 0 ? static_cast<size_t>(total) : 0;
+    }
+
+    // Merges blocks owned by the calling thread that other threads released
+    // past their share; destroys those nobody else holds.
+    static void mergeQueued() noexcept {
+        if (current == nullptr) {
+            return;
+        }
+        Counter* top = current->queued.load(std::memory_order_relaxed);
+        if (top != nullptr && top != Owner::closed()) {
+            mergeList(current->queued.exchange(nullptr,
+                                               std::memory_order_acquire));
+        }
+    }
+};
+
+inline constexpr size_t kCacheLineSize = 64;
+
+// Same counting as Policy, but weak_cnt gets a cache line of its own so that
+// WeakPtr traffic does not dirty the line holding shared_cnt.
+template <typename Policy>
+struct PaddedPolicy : Policy {
+    static constexpr size_t kWeakCounterAlign = kCacheLineSize;
+};
+
+// What SharedPtr and the control blocks need from a policy. The flags select
+// deferred release, statistics, tracking and lazy construction through
+// if constexpr, so a policy that leaves them false compiles to the plain
+// counting code. A policy with kInstrumented set also provides
+// record<Object>(PointerEvent), through which the blocks report events.
+template <typename Policy>
+concept SharedPtrPolicy =
+    requires(typename Policy::Counter& cnt,
+             const typename Policy::Counter& const_cnt,
+             typename Policy::WeakCounter& weak,
+             const typename Policy::WeakCounter& const_weak, size_t n) {
+        { Policy::kDeferredRelease } -> std::convertible_to<bool>;
+        { Policy::kInstrumented } -> std::convertible_to<bool>;
+        { Policy::kTracked } -> std::convertible_to<bool>;
+        { Policy::kLazy } -> std::convertible_to<bool>;
+        { Policy::kWeakCounterAlign } -> std::convertible_to<size_t>;
+        { Policy::increment(cnt) } noexcept;
+        { Policy::add(cnt, n) } noexcept;
+        { Policy::decrement(cnt) } noexcept -> std::same_as<bool>;
+        { Policy::subtract(cnt, n) } noexcept -> std::same_as<bool>;
+        { Policy::incrementIfNonZero(cnt) } noexcept -> std::same_as<bool>;
+        { Policy::load(const_cnt) } noexcept -> std::same_as<size_t>;
+        { Policy::loadAcquire(const_cnt) } noexcept -> std::same_as<size_t>;
+        { Policy::increment(weak) } noexcept;
+        { Policy::decrement(weak) } noexcept -> std::same_as<bool>;
+        { Policy::loadAcquire(const_weak) } noexcept -> std::same_as<size_t>;
+    };
+
+static_assert(SharedPtrPolicy<SingleThreadedPolicy>);
+static_assert(SharedPtrPolicy<AtomicPolicy>);
+static_assert(SharedPtrPolicy<BiasedPolicy>);
+static_assert(SharedPtrPolicy<PaddedPolicy<AtomicPolicy>>);
+
+// The default is plain, non-atomic, trivially copyable counting with none of
+// the optional machinery switched on.
+static_assert(std::is_same_v<DefaultPolicy::Counter, size_t> &&
+              std::is_same_v<DefaultPolicy::WeakCounter, size_t>);
+static_assert(!DefaultPolicy::kDeferredRelease &&
+              !DefaultPolicy::kInstrumented && !DefaultPolicy::kTracked &&
+              !DefaultPolicy::kLazy);
+
+template <typename T, typename Deleter = std::default_delete<T>>
+class UniquePtr;
+
+template <typename Policy>
+class RefCountedBase;
+
+// Defined with the policies that use them, in smart_pointers_deferred.h,
+// smart_pointers_tracking.h and smart_pointers_lazy.h, and only instantiated
+// under those policies.
+template <typename Policy>
+struct DeferredQueue;
+
+template <typename Policy>
+class EpochGuard;
+
+template <typename Policy>
+class BlockTracker;
+
+template <typename Object, typename Policy>
+struct ControlBlockLazyBase;
+
+template <typename Object, typename Policy, typename Alloc, typename... Args>
+struct ControlBlockLazy;
+
+// Access for the batched operations in smart_pointers_batch.h.
+struct SharedPtrBatch;
+
+// Types whose objects can be moved to new storage with memcpy, leaving the
+// source storage to be released without running its destructor.
+template <typename T>
+struct IsTriviallyRelocatable : std::is_trivially_copyable<T> {};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<SharedPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<WeakPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Deleter>
+struct IsTriviallyRelocatable<UniquePtr<T, Deleter>>
+    : IsTriviallyRelocatable<Deleter> {};
+
+template <typename T>
+inline constexpr bool isTriviallyRelocatable = IsTriviallyRelocatable<T>::value;
+
+// weak_cnt counts the WeakPtrs plus one reference held collectively by all
+// SharedPtrs, so the block is freed exactly once by whoever drops it to zero.
+// Control blocks are not polymorphic: each kind supplies a single manager
+// function that destroys the object, frees the block, or both in one call.
+template <typename Policy>
+struct BaseControlBlock {
+    enum class Action { Destroy, Deallocate, DestroyAndDeallocate };
+    using Manager = void (*)(BaseControlBlock*, Action) noexcept;
+    struct NoLink {};
+    struct DeferredLink {
+        BaseControlBlock* next;
+        uint64_t epoch;
+    };
+
+    Manager manager;
+    typename Policy::Counter shared_cnt;
+    alignas(Policy::kWeakCounterAlign) typename Policy::WeakCounter weak_cnt;
+    [[no_unique_address]] std::conditional_t<Policy::kDeferredRelease,
+                                             DeferredLink, NoLink>
+        deferred;
+    BaseControlBlock(Manager manager, size_t shared_cnt, size_t weak_cnt)
+        : manager(manager), shared_cnt(shared_cnt), weak_cnt(weak_cnt) {
+        if constexpr (requires { this->shared_cnt.dispose; }) {
+            this->shared_cnt.dispose = &disposeCounter;
+        }
+    }
+
+    static void disposeCounter(typename Policy::Counter& cnt) noexcept {
+        auto* cb = reinterpret_cast<BaseControlBlock*>(
+            reinterpret_cast<char*>(&cnt) - offsetof(BaseControlBlock,
+                                                     shared_cnt));
+        cb->dispose();
+    }
+
+    void addShared() noexcept {
+        Policy::increment(shared_cnt);
+    }
+
+    void addShared(size_t n) noexcept {
+        Policy::add(shared_cnt, n);
+    }
+
+    bool tryAddShared() noexcept {
+        return Policy::incrementIfNonZero(shared_cnt);
+    }
+
+    void addWeak() noexcept {
+        Policy::increment(weak_cnt);
+    }
+
+    void releaseShared() noexcept {
+        if (Policy::decrement(shared_cnt)) {
+            retire();
+        }
+    }
+
+    void releaseShared(size_t n) noexcept {
+        if (Policy::subtract(shared_cnt, n)) {
+            retire();
+        }
+    }
+
+    void retire() noexcept {
+        if constexpr (Policy::kDeferredRelease) {
+            DeferredQueue<Policy>::push(this);
+        } else {
+            dispose();
+        }
+    }
+
+    // Destroys the object and drops the SharedPtrs' share of weak_cnt.
+    void dispose() noexcept {
+        if (Policy::loadAcquire(weak_cnt) == 1) {
+            manager(this, Action::DestroyAndDeallocate);
+            return;
+        }
+        manager(this, Action::Destroy);
+        releaseWeak();
+    }
+
+    void releaseWeak() noexcept {
+        if (Policy::decrement(weak_cnt)) {
+            manager(this, Action::Deallocate);
+        }
+    }
+
+    size_t useCount() const noexcept {
+        return Policy::load(shared_cnt);
+    }
+};
+
+enum class PointerEvent {
+    MakeShared,
+    Raw,
+    Destroy,
+    Copy,
+    Move,
+    LockHit,
+    LockMiss,
+    Count
+};
+
+template <typename T, typename Deleter>
+class UniquePtr {
+  public:
+    using element_type = std::remove_extent_t<T>;
+
+  private:
+    template <typename U, typename D>
+    friend class UniquePtr;
+
+    element_type* ptr;
+    [[no_unique_address]] Deleter deleter;
+
+  public:
+    constexpr UniquePtr() noexcept : ptr(nullptr), deleter() {}
+
+    constexpr UniquePtr(std::nullptr_t) noexcept : UniquePtr() {}
+
+    explicit UniquePtr(element_type* ptr) noexcept : ptr(ptr), deleter() {}
+
+    UniquePtr(element_type* ptr, Deleter deleter) noexcept
+        : ptr(ptr), deleter(std::move(deleter)) {}
+
+    UniquePtr(const UniquePtr&) = delete;
+
+    UniquePtr(UniquePtr&& other) noexcept
+        : ptr(other.release()), deleter(std::move(other.deleter)) {}
+
+    template <typename Derived, typename D>
+    UniquePtr(UniquePtr<Derived, D>&& other) noexcept
+        : ptr(other.release()), deleter(std::move(other.deleter)) {}
+
+    ~UniquePtr() {
+        if (ptr != nullptr) {
+            deleter(ptr);
+        }
+    }
+
+    UniquePtr& operator=(const UniquePtr&) = delete;
+
+    UniquePtr& operator=(UniquePtr&& other) noexcept {
+        reset(other.release());
+        deleter = std::move(other.deleter);
+        return *this;
+    }
+
+    template <typename Derived, typename D>
+    UniquePtr& operator=(UniquePtr<Derived, D>&& other) noexcept {
+        reset(other.release());
+        deleter = std::move(other.deleter);
+        return *this;
+    }
+
+    element_type* release() noexcept {
+        element_type* result = ptr;
+        ptr = nullptr;
+        return result;
+    }
+
+    void reset(element_type* new_ptr = nullptr) noexcept {
+        element_type* old = ptr;
+        ptr = new_ptr;
+        if (old != nullptr) {
+            deleter(old);
+        }
+    }
+
+    void swap(UniquePtr& other) noexcept {
+        std::swap(ptr, other.ptr);
+        std::swap(deleter, other.deleter);
+    }
+
+    Deleter& get_deleter() noexcept {
+        return deleter;
+    }
+    const Deleter& get_deleter() const noexcept {
+        return deleter;
+    }
+
+    element_type& operator*() const noexcept
+        requires(!std::is_array_v<T>)
+    {
+        return *ptr;
+    }
+    element_type* get() const noexcept {
+        return ptr;
+    }
+    element_type* operator->() const noexcept
+        requires(!std::is_array_v<T>)
+    {
+        return ptr;
+    }
+    element_type& operator[](ptrdiff_t index) const noexcept
+        requires std::is_array_v<T>
+    {
+        return ptr[index];
+    }
+};
+
+template <typename T, typename... Args>
+    requires(!std::is_array_v<T>)
+UniquePtr<T> makeUnique(Args&&... args) {
+    return UniquePtr<T>(new T(std::forward<Args>(args)...));
+}
+
 template <typename T>
-class WeakPtr;
+    requires std::is_unbounded_array_v<T>
+UniquePtr<T> makeUnique(size_t size) {
+    return UniquePtr<T>(new std::remove_extent_t<T>[size]());
+}
+
+// Control-block kinds. They live outside SharedPtr and are keyed by what they
+// store rather than by the pointer type, so SharedPtr<T> and
+// SharedPtr<const T> share the kinds that hold the object in place. The
+// kinds for an object allocated elsewhere keep it as void*; only the function
+// that deletes it is instantiated per element type.
+
+template <typename Object, typename Policy>
+void recordEvent([[maybe_unused]] PointerEvent event) noexcept {
+    if constexpr (Policy::kInstrumented) {
+        Policy::template record<Object>(event);
+    }
+}
+
+struct ForOverwriteTag {};
+
+inline void* untypedAddress(const volatile void* ptr) noexcept {
+    return const_cast<void*>(ptr);
+}
+
+// The manager doubles as the typed delete function, so the block costs no
+// more than the deleter, the allocator and the pointer.
+template <typename Policy, typename Deleter, typename Alloc>
+struct ControlBlockRegular : public BaseControlBlock<Policy> {
+    using Base = BaseControlBlock<Policy>;
+    using Action = typename Base::Action;
+    using AllocBlock = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<ControlBlockRegular>;
+
+    [[no_unique_address]] Deleter deleter;
+    [[no_unique_address]] AllocBlock alloc;
+    void* ptr;
+
+    template <typename Element>
+    ControlBlockRegular(Element* ptr, Deleter&& deleter, AllocBlock&& alloc)
+        : Base(&manage<Element>, 1, 1),
+          deleter(std::move(deleter)),
+          alloc(std::move(alloc)),
+          ptr(untypedAddress(ptr)) {}
+
+    template <typename Element>
+    static void manage(Base* base, Action action) noexcept {
+        auto* cb = static_cast<ControlBlockRegular*>(base);
+        if (action != Action::Deallocate) {
+            recordEvent<std::remove_cv_t<Element>, Policy>(
+                PointerEvent::Destroy);
+            cb->template useDeleter<Element>();
+        }
+        if (action != Action::Destroy) {
+            cb->Deallocate();
+        }
+    }
+
+    template <typename Element>
+    void useDeleter() {
+        deleter(static_cast<Element*>(ptr));
+    }
+
+    void Deallocate() {
+        AllocBlock block_alloc = std::move(alloc);
+        this->~ControlBlockRegular();
+        std::allocator_traits<AllocBlock>::deallocate(block_alloc, this, 1);
+    }
+};
+
+// Custom deleters with the default allocator share this one block kind
+// and manager per policy instead of a ControlBlockRegular each. The
+// deleter sits in an inline buffer when it fits and moves without
+// throwing, otherwise on the heap; only the small function that calls and
+// destroys it is instantiated per element and deleter type.
+template <typename Policy>
+struct ControlBlockErased : public BaseControlBlock<Policy> {
+    using Base = BaseControlBlock<Policy>;
+    using Action = typename Base::Action;
+    using AllocBlock = std::allocator<ControlBlockErased>;
+    using DeleteObject = void (*)(void* storage, void* ptr);
+
+    static constexpr size_t kInlineSize = 3 * sizeof(void*);
+
+    DeleteObject delete_object;
+    alignas(void*) unsigned char storage[kInlineSize];
+    void* ptr;
+
+    template <typename Deleter>
+    static constexpr bool kFitsInline =
+        sizeof(Deleter) <= kInlineSize && alignof(Deleter) <= alignof(void*) &&
+        std::is_nothrow_move_constructible_v<Deleter>;
+
+    template <typename Element, typename Deleter>
+    ControlBlockErased(Element* ptr, Deleter&& deleter, AllocBlock&&)
+        : Base(&manage, 1, 1), ptr(untypedAddress(ptr)) {
+        if constexpr (kFitsInline<Deleter>) {
+            ::new (static_cast<void*>(storage)) Deleter(std::move(deleter));
+            delete_object = &deleteInline<Element, Deleter>;
+        } else {
+            ::new (static_cast<void*>(storage))
+                Deleter*(new Deleter(std::move(deleter)));
+            delete_object = &deleteHeap<Element, Deleter>;
+        }
+    }
+
+    template <typename Element, typename Deleter>
+    static void deleteInline(void* storage, void* ptr) {
+        recordEvent<std::remove_cv_t<Element>, Policy>(PointerEvent::Destroy);
+        Deleter& deleter = *std::launder(static_cast<Deleter*>(storage));
+        deleter(static_cast<Element*>(ptr));
+        deleter.~Deleter();
+    }
+
+    template <typename Element, typename Deleter>
+    static void deleteHeap(void* storage, void* ptr) {
+        recordEvent<std::remove_cv_t<Element>, Policy>(PointerEvent::Destroy);
+        Deleter* deleter = *std::launder(static_cast<Deleter**>(storage));
+        (*deleter)(static_cast<Element*>(ptr));
+        delete deleter;
+    }
+
+    static void manage(Base* base, Action action) noexcept {
+        auto* cb = static_cast<ControlBlockErased*>(base);
+        if (action != Action::Deallocate) {
+            cb->delete_object(cb->storage, cb->ptr);
+        }
+        if (action != Action::Destroy) {
+            cb->Deallocate();
+        }
+    }
+
+    void Deallocate() {
+        AllocBlock block_alloc;
+        this->~ControlBlockErased();
+        std::allocator_traits<AllocBlock>::deallocate(block_alloc, this, 1);
+    }
+};
+
+// Padded blocks start the object on a fresh cache line, so writes to it
+// do not contend with reference counting.
+template <typename Object, typename Policy, typename Alloc, bool Padded>
+struct ControlBlockMakeShared : public BaseControlBlock<Policy> {
+    using Base = BaseControlBlock<Policy>;
+    using Action = typename Base::Action;
+    using AllocObject =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Object>;
+
+    static constexpr size_t kDataAlign =
+        Padded && alignof(Object) < kCacheLineSize ? kCacheLineSize
+                                                   : alignof(Object);
+
+    [[no_unique_address]] AllocObject alloc;
+    union alignas(kDataAlign) {
+        Object data;
+    };
+
+    // The object is built through the allocator, as allocate_shared
+    // does, so uses-allocator construction reaches it under pmr.
+    template <typename... Args>
+    ControlBlockMakeShared(const Alloc& alloc, Args&&... args)
+        : Base(&manage, 1, 1), alloc(alloc) {
+        std::allocator_traits<AllocObject>::construct(
+            this->alloc, object(), std::forward<Args>(args)...);
+    }
+
+    ControlBlockMakeShared(const Alloc& alloc, ForOverwriteTag)
+        : Base(&manage, 1, 1), alloc(alloc) {
+        ::new (static_cast<void*>(object())) Object;
+    }
+
+    Object* object() noexcept {
+        return std::addressof(data);
+    }
+
+    ~ControlBlockMakeShared() {}
+
+    static void manage(Base* base, Action action) noexcept {
+        auto* cb = static_cast<ControlBlockMakeShared*>(base);
+        if (action != Action::Deallocate) {
+            recordEvent<Object, Policy>(PointerEvent::Destroy);
+            cb->Destroy();
+        }
+        if (action != Action::Destroy) {
+            cb->Deallocate();
+        }
+    }
+
+    void Destroy() {
+        std::allocator_traits<AllocObject>::destroy(alloc, object());
+    }
+
+    void Deallocate() {
+        using AllocBlock = typename std::allocator_traits<
+            Alloc>::template rebind_alloc<ControlBlockMakeShared>;
+
+        AllocBlock block_alloc(std::move(alloc));
+        this->~ControlBlockMakeShared();
+        std::allocator_traits<AllocBlock>::deallocate(block_alloc, this, 1);
+    }
+};
+
+// The elements follow the block header in the same allocation, which is
+// made in units aligned for both the header and the element type.
+template <typename Element, typename Policy, typename Alloc>
+struct ControlBlockMakeSharedArray : public BaseControlBlock<Policy> {
+    using Base = BaseControlBlock<Policy>;
+    using Action = typename Base::Action;
+
+    static_assert(!std::is_array_v<Element>,
+                  "multidimensional arrays are not supported");
+
+    static constexpr size_t kAlignment = alignof(Element) > alignof(Base)
+                                             ? alignof(Element)
+                                             : alignof(Base);
+
+    struct alignas(kAlignment) Unit {
+        unsigned char bytes[kAlignment];
+    };
+
+    using AllocUnit =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Unit>;
+    using AllocElement =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Element>;
+
+    [[no_unique_address]] AllocElement alloc;
+    size_t size;
+
+    ControlBlockMakeSharedArray(AllocElement&& alloc, size_t size)
+        : Base(&manage, 1, 1), alloc(std::move(alloc)), size(size) {}
+
+    static constexpr size_t dataOffset() noexcept {
+        constexpr size_t align = alignof(Element);
+        return (sizeof(ControlBlockMakeSharedArray) + align - 1) / align *
+               align;
+    }
+
+    static size_t unitsFor(size_t size) {
+        if (size > (SIZE_MAX - dataOffset()) / sizeof(Element)) {
+            throw std::bad_array_new_length();
+        }
+        return (dataOffset() + size * sizeof(Element) + sizeof(Unit) - 1) /
+               sizeof(Unit);
+    }
+
+    template <typename Construct>
+    static ControlBlockMakeSharedArray* create(const Alloc& alloc, size_t size,
+                                               Construct construct) {
+        AllocUnit unit_alloc(alloc);
+        size_t units = unitsFor(size);
+        Unit* memory =
+            std::allocator_traits<AllocUnit>::allocate(unit_alloc, units);
+        auto* cb = ::new (static_cast<void*>(memory))
+            ControlBlockMakeSharedArray(AllocElement(unit_alloc), size);
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                construct(cb->alloc, cb->data() + constructed);
+            }
+        } catch (...) {
+            cb->destroyElements(constructed);
+            cb->~ControlBlockMakeSharedArray();
+            std::allocator_traits<AllocUnit>::deallocate(unit_alloc, memory,
+                                                         units);
+            throw;
+        }
+        return cb;
+    }
+
+    Element* data() noexcept {
+        return reinterpret_cast<Element*>(
+            reinterpret_cast<unsigned char*>(this) + dataOffset());
+    }
+
+    static void manage(Base* base, Action action) noexcept {
+        auto* cb = static_cast<ControlBlockMakeSharedArray*>(base);
+        if (action != Action::Deallocate) {
+            recordEvent<Element, Policy>(PointerEvent::Destroy);
+            cb->Destroy();
+        }
+        if (action != Action::Destroy) {
+            cb->Deallocate();
+        }
+    }
+
+    void destroyElements(size_t count) noexcept {
+        while (count != 0) {
+            --count;
+            std::allocator_traits<AllocElement>::destroy(alloc,
+                                                         data() + count);
+        }
+    }
+
+    void Destroy() {
+        destroyElements(size);
+    }
+
+    void Deallocate() {
+        AllocUnit unit_alloc(std::move(alloc));
+        size_t units = unitsFor(size);
+        this->~ControlBlockMakeSharedArray();
+        std::allocator_traits<AllocUnit>::deallocate(
+            unit_alloc, reinterpret_cast<Unit*>(this), units);
+    }
+};
+
+template <typename T, typename Policy>
+class SharedPtr {
+    static_assert(SharedPtrPolicy<Policy>);
+
+  public:
+    using element_type = std::remove_extent_t<T>;
+
+  private:
+    template <typename U, typename P>
+    friend class WeakPtr;
+
+    template <typename U, typename P>
+    friend class SharedPtr;
+
+    template <typename U>
+    friend class AtomicSharedPtr;
+
+    template <typename U, typename P>
+    friend class IntrusivePtr;
+
+    template <typename U, typename P>
+    friend class CompactSharedPtr;
+
+    template <typename U, typename P>
+    friend class EnableSharedFromThis;
+
+    template <typename U, typename P>
+    friend class BorrowedPtr;
+
+    template <typename P>
+    friend class BlockTracker;
+
+    template <typename U, typename P, typename R>
+    friend class RecyclingPool;
+
+    friend struct SharedPtrBatch;
+
+    template <typename U, typename P, typename A, typename... Args>
+    friend struct ::ControlBlockLazy;
+
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
+
+    using Action = typename BaseControlBlock::Action;
+
+    using DefaultDeleter =
+        std::conditional_t<std::is_array_v<T>,
+                           std::default_delete<element_type[]>,
+                           std::default_delete<T>>;
+
+    using DefaultAllocator = std::allocator<std::remove_cv_t<element_type>>;
+
+    using ForOverwrite = ForOverwriteTag;
+
+    void track() noexcept {
+        if constexpr (Policy::kTracked) {
+            BlockTracker<Policy>::template add<
+                std::remove_cv_t<element_type>, std::is_array_v<T>>(cb, ptr);
+        }
+    }
+
+    static void record(PointerEvent event) noexcept {
+        recordEvent<std::remove_cv_t<element_type>, Policy>(event);
+    }
+
+    template <typename Deleter, typename Alloc>
+    using ControlBlockRegular = ::ControlBlockRegular<Policy, Deleter, Alloc>;
+
+    using ControlBlockErased = ::ControlBlockErased<Policy>;
+
+    template <typename Deleter, typename Alloc>
+    using ControlBlockFor =
+        std::conditional_t<std::is_same_v<Alloc, DefaultAllocator> &&
+                               !std::is_same_v<Deleter, DefaultDeleter>,
+                           ControlBlockErased,
+                           ControlBlockRegular<Deleter, Alloc>>;
+
+    // Builds the block that will own ptr, deleting nothing if that throws.
+    // Rebinding is the only copy of the allocator; the block takes it and the
+    // deleter by move once its storage exists. Allocator moves leave the
+    // source usable.
+    template <typename Deleter, typename Alloc>
+    static BaseControlBlock* newBlock(element_type* ptr, Deleter& deleter,
+                                      Alloc&& alloc) {
+        using Block = ControlBlockFor<Deleter, std::remove_cvref_t<Alloc>>;
+        using AllocBlock = typename Block::AllocBlock;
+
+        AllocBlock block_alloc(std::move(alloc));
+        Block* block =
+            std::allocator_traits<AllocBlock>::allocate(block_alloc, 1);
+        try {
+            std::allocator_traits<AllocBlock>::construct(
+                block_alloc, block, ptr, std::move(deleter),
+                std::move(block_alloc));
+        } catch (...) {
+            std::allocator_traits<AllocBlock>::deallocate(block_alloc, block,
+                                                          1);
+            throw;
+        }
+        return block;
+    }
+
+    template <typename Alloc, bool Padded = false>
+    using ControlBlockMakeShared =
+        ::ControlBlockMakeShared<std::remove_cv_t<T>, Policy, Alloc, Padded>;
+
+    template <typename Alloc>
+    using ControlBlockMakeSharedArray =
+        ::ControlBlockMakeSharedArray<std::remove_cv_t<element_type>, Policy,
+                                      Alloc>;
+
+    using ControlBlockLazyBase =
+        ::ControlBlockLazyBase<std::remove_cv_t<T>, Policy>;
+
+    // What construction does for a new object, run once a lazy one is built.
+    static void adoptBuilt(BaseControlBlock* cb,
+                           element_type* object) noexcept {
+        SharedPtr handle;
+        handle.cb = cb;
+        handle.ptr = object;
+        handle.track();
+        handle.bindObject();
+        handle.cb = nullptr;
+        handle.ptr = nullptr;
+    }
+
+    static element_type* lazyTag() noexcept {
+        static constinit char tag = 0;
+        return reinterpret_cast<element_type*>(&tag);
+    }
+
+    element_type* materialize() const {
+        return static_cast<ControlBlockLazyBase*>(cb)->materialize();
+    }
+
+    // ptr, or the object's address if ptr is the tag of a lazy object that
+    // has been built since.
+    constexpr element_type* resolved() const noexcept {
+        if constexpr (Policy::kLazy && !std::is_array_v<T>) {
+            if (ptr == lazyTag()) {
+                if (element_type* address =
+                        static_cast<ControlBlockLazyBase*>(cb)->builtAddress()) {
+                    return address;
+                }
+            }
+        }
+        return ptr;
+    }
+
+    BaseControlBlock* cb;
+    element_type* ptr;
+
+  public:
+    constexpr SharedPtr() noexcept : cb(nullptr), ptr(nullptr) {}
+
+    // Empty, as opposed to SharedPtr(static_cast<T*>(nullptr)), which
+    // allocates a block owning the null pointer.
+    constexpr SharedPtr(std::nullptr_t) noexcept : SharedPtr() {}
+
+    template <typename Deleter = DefaultDeleter,
+              typename Alloc = DefaultAllocator>
+    SharedPtr(element_type* ptr, Deleter deleter = Deleter(),
+              Alloc alloc = Alloc())
+        : cb(nullptr), ptr(ptr) {
+        try {
+            cb = newBlock(ptr, deleter, std::move(alloc));
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
+        record(PointerEvent::Raw);
+        track();
+        bindObject();
+    }
+
+    // The UniquePtr keeps its pointer and deleter until the block exists, so
+    // a failed promotion leaves it unchanged.
+    template <typename Deleter>
+    SharedPtr(UniquePtr<T, Deleter>&& unique) : cb(nullptr), ptr(nullptr) {
+        if (unique.get() == nullptr) {
+            return;
+        }
+        cb = newBlock(unique.get(), unique.get_deleter(), DefaultAllocator());
+        ptr = unique.release();
+        record(PointerEvent::Raw);
+        track();
+        bindObject();
+    }
+
+    constexpr SharedPtr(const SharedPtr& other) noexcept
+        : cb(other.cb), ptr(other.resolved()) {
+        if (cb != nullptr) {
+            cb->addShared();
+            record(PointerEvent::Copy);
+        }
+    }
+
+    constexpr SharedPtr(SharedPtr&& other) noexcept
+        : cb(other.cb), ptr(other.ptr) {
+        other.ptr = nullptr;
+        other.cb = nullptr;
+        if (cb != nullptr) {
+            record(PointerEvent::Move);
+        }
+    }
+
+    template <typename Derived>
+    SharedPtr(const SharedPtr<Derived, Policy>& other) noexcept(!Policy::kLazy)
+        : cb(static_cast<BaseControlBlock*>(other.cb)),
+          ptr(static_cast<element_type*>(other.get())) {
+        if (cb != nullptr) {
+            cb->addShared();
+            record(PointerEvent::Copy);
+        }
+    }
+
+    template <typename Derived>
+    SharedPtr(SharedPtr<Derived, Policy>&& other) noexcept(!Policy::kLazy)
+        : cb(static_cast<BaseControlBlock*>(other.cb)),
+          ptr(static_cast<element_type*>(other.get())) {
+        other.ptr = nullptr;
+        other.cb = nullptr;
+        if (cb != nullptr) {
+            record(PointerEvent::Move);
+        }
+    }
+
+    // A block is counted by the policy it was made with for its whole life,
+    // so pointers never convert between policies, not even to a policy that
+    // derives from or adapts this one.
+    template <typename U, typename OtherPolicy>
+        requires(!std::is_same_v<OtherPolicy, Policy>)
+    SharedPtr(const SharedPtr<U, OtherPolicy>&) = delete;
+
+    template <typename U>
+    SharedPtr(const SharedPtr<U, Policy>& owner, element_type* ptr) noexcept
+        : cb(owner.cb), ptr(ptr) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    template <typename U>
+    SharedPtr(SharedPtr<U, Policy>&& owner, element_type* ptr) noexcept
+        : cb(owner.cb), ptr(ptr) {
+        owner.ptr = nullptr;
+        owner.cb = nullptr;
+    }
+
+    constexpr ~SharedPtr() {
+        if (cb == nullptr) {
+            return;
+        }
+        cb->releaseShared();
+        cb = nullptr;
+        ptr = nullptr;
+    }
+
+  private:
+    template <typename Alloc, bool Padded>
+    SharedPtr(ControlBlockMakeShared<Alloc, Padded>* cb) noexcept
+        : cb(cb), ptr(&cb->data) {
+        record(PointerEvent::MakeShared);
+        track();
+        bindObject();
+    }
+
+    template <bool Padded, typename Alloc, typename... Args>
+    static SharedPtr allocateObject(const Alloc& alloc, Args&&... args) {
+        using Block = ControlBlockMakeShared<Alloc, Padded>;
+        using AllocBlock = typename std::allocator_traits<
+            Alloc>::template rebind_alloc<Block>;
+        AllocBlock new_alloc = alloc;
+        Block* cb = std::allocator_traits<AllocBlock>::allocate(new_alloc, 1);
+        try {
+            std::allocator_traits<AllocBlock>::construct(
+                new_alloc, cb, alloc, std::forward<Args>(args)...);
+        } catch (...) {
+            std::allocator_traits<AllocBlock>::deallocate(new_alloc, cb, 1);
+            throw;
+        }
+        return SharedPtr(cb);
+    }
+
+    template <typename Alloc>
+    SharedPtr(ControlBlockMakeSharedArray<Alloc>* cb) noexcept
+        : cb(cb), ptr(cb->data()) {
+        record(PointerEvent::MakeShared);
+        track();
+    }
+
+    template <typename Alloc, typename... Value>
+    static SharedPtr allocateArray(const Alloc& alloc, size_t size,
+                                   const Value&... value) {
+        using Block = ControlBlockMakeSharedArray<Alloc>;
+        return SharedPtr(Block::create(
+            alloc, size,
+            [&](typename Block::AllocElement& element_alloc, auto* element) {
+                std::allocator_traits<typename Block::AllocElement>::construct(
+                    element_alloc, element, value...);
+            }));
+    }
+
+    template <typename Alloc>
+    static SharedPtr allocateArrayForOverwrite(const Alloc& alloc,
+                                               size_t size) {
+        using Block = ControlBlockMakeSharedArray<Alloc>;
+        return SharedPtr(Block::create(
+            alloc, size, [](typename Block::AllocElement&, auto* element) {
+                using Element = std::remove_pointer_t<decltype(element)>;
+                ::new (static_cast<void*>(element)) Element;
+            }));
+    }
+
+    // Tells an object that knows its owner which block it now lives under.
+    void bindObject() noexcept {
+        if (ptr == nullptr) {
+            return;
+        }
+        if constexpr (std::is_base_of_v<RefCountedBase<Policy>, T>) {
+            static_cast<const RefCountedBase<Policy>*>(ptr)->cb = cb;
+        }
+        if constexpr (!std::is_array_v<T>) {
+            enableSharedFromThis(ptr);
+        }
+    }
+
+    template <typename U>
+    void enableSharedFromThis(
+        const EnableSharedFromThis<U, Policy>* base) noexcept {
+        if (!base->wptr.expired()) {
+            return;
+        }
+        WeakPtr<U, Policy> weak;
+        cb->addWeak();
+        weak.cb = cb;
+        weak.ptr = static_cast<U*>(
+            const_cast<std::remove_cv_t<element_type>*>(ptr));
+        base->wptr = std::move(weak);
+    }
+
+    void enableSharedFromThis(...) noexcept {}
+
+    SharedPtr(const WeakPtr<T, Policy>& weak) noexcept
+        : cb(nullptr), ptr(nullptr) {
+        if (weak.cb != nullptr && weak.cb->tryAddShared()) {
+            cb = weak.cb;
+            ptr = weak.ptr;
+        }
+        record(cb != nullptr ? PointerEvent::LockHit : PointerEvent::LockMiss);
+    }
+
+  public:
+    void swap(SharedPtr& other) noexcept {
+        std::swap(cb, other.cb);
+        std::swap(ptr, other.ptr);
+    }
+
+    SharedPtr& operator=(const SharedPtr& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        SharedPtr tmp(other);
+        swap(tmp);
+        return *this;
+    }
+
+    SharedPtr& operator=(SharedPtr&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        SharedPtr tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template <typename Derived>
+    SharedPtr& operator=(const SharedPtr<Derived, Policy>& other) noexcept {
+        if (static_cast<void*>(this) == static_cast<const void*>(&other)) {
+            return *this;
+        }
+        SharedPtr tmp(other);
+        swap(tmp);
+        return *this;
+    }
+
+    template <typename Derived>
+    SharedPtr& operator=(SharedPtr<Derived, Policy>&& other) noexcept {
+        if (static_cast<void*>(this) == static_cast<void*>(&other)) {
+            return *this;
+        }
+        SharedPtr tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template <typename Deleter>
+    SharedPtr& operator=(UniquePtr<T, Deleter>&& unique) {
+        SharedPtr tmp(std::move(unique));
+        swap(tmp);
+        return *this;
+    }
+
+    template <typename Deleter = DefaultDeleter,
+              typename Alloc = DefaultAllocator>
+    void reset(element_type* ptr, Deleter deleter = Deleter(),
+               Alloc alloc = Alloc()) {
+        SharedPtr tmp(ptr, std::move(deleter), std::move(alloc));
+        swap(tmp);
+    }
+    void reset() noexcept {
+        SharedPtr tmp;
+        swap(tmp);
+    }
+
+    constexpr size_t use_count() const noexcept {
+        return cb == nullptr ? 0 : cb->useCount();
+    }
+
+    template <typename U, typename P, typename... Args>
+    friend SharedPtr<U, P> makeShared(Args&&... args);
+
+    template <typename U, typename P, typename Alloc, typename... Args>
+    friend SharedPtr<U, P> allocateShared(Alloc alloc, Args&&... args);
+
+    template <typename U, typename P, typename Alloc, typename... Size>
+    friend SharedPtr<U, P> allocateSharedForOverwrite(Alloc alloc,
+                                                      Size... size);
+
+    template <typename U, typename P, typename Alloc, typename... Args>
+        requires(!std::is_array_v<U>)
+    friend SharedPtr<U, P> allocateSharedPadded(Alloc alloc, Args&&... args);
+
+    template <typename U, typename P, typename Alloc>
+    friend struct ControlBlockLayout;
+
+    constexpr element_type& operator*() const noexcept(!Policy::kLazy)
+        requires(!std::is_array_v<T>)
+    {
+        return *get();
+    }
+    constexpr element_type* get() const noexcept(!Policy::kLazy) {
+        if constexpr (Policy::kLazy && !std::is_array_v<T>) {
+            if (ptr == lazyTag()) {
+                return materialize();
+            }
+        }
+        return ptr;
+    }
+    constexpr element_type* operator->() const noexcept(!Policy::kLazy)
+        requires(!std::is_array_v<T>)
+    {
+        return get();
+    }
+    element_type& operator[](ptrdiff_t index) const noexcept
+        requires std::is_array_v<T>
+    {
+        return ptr[index];
+    }
+};
+
+template <typename T, typename Policy = DefaultPolicy, typename Alloc,
+          typename... Args>
+SharedPtr<T, Policy> allocateShared(Alloc alloc, Args&&... args) {
+    if constexpr (std::is_unbounded_array_v<T>) {
+        return SharedPtr<T, Policy>::allocateArray(alloc, args...);
+    } else if constexpr (std::is_bounded_array_v<T>) {
+        return SharedPtr<T, Policy>::allocateArray(alloc, std::extent_v<T>,
+                                                   args...);
+    } else {
+        return SharedPtr<T, Policy>::template allocateObject<false>(
+            alloc, std::forward<Args>(args)...);
+    }
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+SharedPtr<T, Policy> makeShared(Args&&... args) {
+    return allocateShared<T, Policy>(
+        std::allocator<std::remove_cv_t<std::remove_extent_t<T>>>(),
+        std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename Alloc,
+          typename... Args>
+    requires(!std::is_array_v<T>)
+SharedPtr<T, Policy> allocateSharedPadded(Alloc alloc, Args&&... args) {
+    return SharedPtr<T, Policy>::template allocateObject<true>(
+        alloc, std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+    requires(!std::is_array_v<T>)
+SharedPtr<T, Policy> makeSharedPadded(Args&&... args) {
+    return allocateSharedPadded<T, Policy>(
+        std::allocator<std::remove_cv_t<T>>(), std::forward<Args>(args)...);
+}
+
+// Size, alignment and object offset of each control-block kind for T;
+// data_offset is 0 for the regular and erased blocks, whose object lives
+// elsewhere.
+// Control blocks are not standard-layout, so offsetof is only conditionally
+// supported; GCC and Clang both handle it.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+template <typename T, typename Policy = DefaultPolicy,
+          typename Alloc = std::allocator<std::remove_cv_t<T>>>
+struct ControlBlockLayout {
+    struct Kind {
+        size_t size;
+        size_t alignment;
+        size_t data_offset;
+    };
+
+  private:
+    using Ptr = SharedPtr<T, Policy>;
+    using Header = BaseControlBlock<Policy>;
+    using Regular = typename Ptr::template ControlBlockRegular<
+        typename Ptr::DefaultDeleter, Alloc>;
+    using Inline = typename Ptr::template ControlBlockMakeShared<Alloc, false>;
+    using Padded = typename Ptr::template ControlBlockMakeShared<Alloc, true>;
+    using Erased = typename Ptr::ControlBlockErased;
+
+  public:
+    static constexpr size_t shared_cnt_offset = offsetof(Header, shared_cnt);
+    static constexpr size_t weak_cnt_offset = offsetof(Header, weak_cnt);
+    static constexpr Kind regular{sizeof(Regular), alignof(Regular), 0};
+    static constexpr Kind erased{sizeof(Erased), alignof(Erased), 0};
+    static constexpr Kind make_shared{sizeof(Inline), alignof(Inline),
+                                      offsetof(Inline, data)};
+    static constexpr Kind padded{sizeof(Padded), alignof(Padded),
+                                 offsetof(Padded, data)};
+};
+#pragma GCC diagnostic pop
+
+template <typename T, typename Policy = DefaultPolicy, typename Alloc,
+          typename... Size>
+SharedPtr<T, Policy> allocateSharedForOverwrite(Alloc alloc, Size... size) {
+    if constexpr (std::is_unbounded_array_v<T>) {
+        return SharedPtr<T, Policy>::allocateArrayForOverwrite(alloc,
+                                                               size...);
+    } else if constexpr (std::is_bounded_array_v<T>) {
+        static_assert(sizeof...(Size) == 0);
+        return SharedPtr<T, Policy>::allocateArrayForOverwrite(
+            alloc, std::extent_v<T>);
+    } else {
+        static_assert(sizeof...(Size) == 0);
+        return allocateShared<T, Policy>(
+            alloc, typename SharedPtr<T, Policy>::ForOverwrite());
+    }
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename... Size>
+SharedPtr<T, Policy> makeSharedForOverwrite(Size... size) {
+    return allocateSharedForOverwrite<T, Policy>(
+        std::allocator<std::remove_cv_t<std::remove_extent_t<T>>>(), size...);
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> staticPointerCast(
+    const SharedPtr<U, Policy>& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    return SharedPtr<T, Policy>(other, static_cast<Element*>(other.get()));
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> staticPointerCast(SharedPtr<U, Policy>&& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    Element* ptr = static_cast<Element*>(other.get());
+    return SharedPtr<T, Policy>(std::move(other), ptr);
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> dynamicPointerCast(
+    const SharedPtr<U, Policy>& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    if (Element* ptr = dynamic_cast<Element*>(other.get())) {
+        return SharedPtr<T, Policy>(other, ptr);
+    }
+    return SharedPtr<T, Policy>();
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> dynamicPointerCast(SharedPtr<U, Policy>&& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    if (Element* ptr = dynamic_cast<Element*>(other.get())) {
+        return SharedPtr<T, Policy>(std::move(other), ptr);
+    }
+    return SharedPtr<T, Policy>();
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> constPointerCast(
+    const SharedPtr<U, Policy>& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    return SharedPtr<T, Policy>(other, const_cast<Element*>(other.get()));
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> constPointerCast(SharedPtr<U, Policy>&& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    Element* ptr = const_cast<Element*>(other.get());
+    return SharedPtr<T, Policy>(std::move(other), ptr);
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> reinterpretPointerCast(
+    const SharedPtr<U, Policy>& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    return SharedPtr<T, Policy>(other, reinterpret_cast<Element*>(other.get()));
+}
+
+template <typename T, typename U, typename Policy>
+SharedPtr<T, Policy> reinterpretPointerCast(
+    SharedPtr<U, Policy>&& other) noexcept {
+    using Element = typename SharedPtr<T, Policy>::element_type;
+    Element* ptr = reinterpret_cast<Element*>(other.get());
+    return SharedPtr<T, Policy>(std::move(other), ptr);
+}
+
+template <typename T, typename Policy>
+class WeakPtr {
+    static_assert(SharedPtrPolicy<Policy>);
+
+  public:
+    using element_type = std::remove_extent_t<T>;
+
+  private:
+    template <typename U, typename P>
+    friend class WeakPtr;
+
+    template <typename U, typename P>
+    friend class SharedPtr;
+
+    template <typename U, typename P>
+    friend class RefCounted;
+
+    template <typename U, typename P>
+    friend class EnableSharedFromThis;
+
+    template <typename U, typename P>
+    friend class BorrowedPtr;
+
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
+
+    BaseControlBlock* cb;
+    element_type* ptr;
+
+    WeakPtr& assignCopy(BaseControlBlock* other_cb,
+                        element_type* other_ptr) noexcept {
+        if (other_cb != cb) {
+            if (other_cb != nullptr) {
+                other_cb->addWeak();
+            }
+            if (cb != nullptr) {
+                cb->releaseWeak();
+            }
+            cb = other_cb;
+        }
+        ptr = other_cb == nullptr ? nullptr : other_ptr;
+        return *this;
+    }
+
+    template <typename Derived>
+    WeakPtr& assignMove(WeakPtr<Derived, Policy>& other) noexcept {
+        if (static_cast<void*>(&other) == static_cast<void*>(this)) {
+            return *this;
+        }
+        WeakPtr tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+  public:
+    constexpr WeakPtr() noexcept : cb(nullptr), ptr(nullptr) {}
+    WeakPtr(const SharedPtr<T, Policy>& shared) noexcept(!Policy::kLazy)
+        : cb(shared.cb), ptr(shared.get()) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    WeakPtr(SharedPtr<T, Policy>&& shared) noexcept(!Policy::kLazy)
+        : cb(shared.cb), ptr(shared.get()) {
+        shared.ptr = nullptr;
+        shared.cb = nullptr;
+        if (cb != nullptr) {
+            cb->addWeak();
+            cb->releaseShared();
+        }
+    }
+
+    template <typename Derived>
+    WeakPtr(const SharedPtr<Derived, Policy>& shared) noexcept(!Policy::kLazy)
+        : cb(static_cast<BaseControlBlock*>(shared.cb)),
+          ptr(static_cast<element_type*>(shared.get())) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    template <typename Derived>
+    WeakPtr(SharedPtr<Derived, Policy>&& shared) noexcept(!Policy::kLazy)
+        : cb(static_cast<BaseControlBlock*>(shared.cb)),
+          ptr(static_cast<element_type*>(shared.get())) {
+        shared.ptr = nullptr;
+        shared.cb = nullptr;
+        if (cb != nullptr) {
+            cb->addWeak();
+            cb->releaseShared();
+        }
+    }
+
+    constexpr WeakPtr(const WeakPtr& other) noexcept
+        : cb(other.cb), ptr(other.ptr) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+    constexpr WeakPtr(WeakPtr&& other) noexcept
+        : cb(other.cb), ptr(other.ptr) {
+        other.cb = nullptr;
+        other.ptr = nullptr;
+    }
+
+    template <typename Derived>
+    WeakPtr(const WeakPtr<Derived, Policy>& shared) noexcept
+        : cb(static_cast<BaseControlBlock*>(shared.cb)),
+          ptr(static_cast<element_type*>(shared.get())) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    template <typename Derived>
+    WeakPtr(WeakPtr<Derived, Policy>&& other) noexcept
+        : cb(static_cast<BaseControlBlock*>(other.cb)),
+          ptr(static_cast<element_type*>(other.ptr)) {
+        other.cb = nullptr;
+        other.ptr = nullptr;
+    }
+
+    // As for SharedPtr, there are no conversions between policies.
+    template <typename U, typename OtherPolicy>
+        requires(!std::is_same_v<OtherPolicy, Policy>)
+    WeakPtr(const SharedPtr<U, OtherPolicy>&) = delete;
+
+    template <typename U, typename OtherPolicy>
+        requires(!std::is_same_v<OtherPolicy, Policy>)
+    WeakPtr(const WeakPtr<U, OtherPolicy>&) = delete;
+
+    constexpr ~WeakPtr() {
+        if (cb == nullptr) {
+            return;
+        }
+        cb->releaseWeak();
+        cb = nullptr;
+        ptr = nullptr;
+    }
+
+    void swap(WeakPtr& other) noexcept {
+        std::swap(cb, other.cb);
+        std::swap(ptr, other.ptr);
+    }
+
+    // Assignments from a pointer into the same block keep the weak reference
+    // already held instead of taking a new one and dropping the old.
+    WeakPtr& operator=(const WeakPtr& other) noexcept {
+        return assignCopy(other.cb, other.ptr);
+    }
+
+    WeakPtr& operator=(WeakPtr&& other) noexcept {
+        return assignMove(other);
+    }
+
+    template <typename Derived>
+    WeakPtr& operator=(const SharedPtr<Derived, Policy>& shared) noexcept(
+        !Policy::kLazy) {
+        return assignCopy(static_cast<BaseControlBlock*>(shared.cb),
+                          static_cast<element_type*>(shared.get()));
+    }
+
+    template <typename Derived>
+    WeakPtr& operator=(SharedPtr<Derived, Policy>&& shared) noexcept(
+        !Policy::kLazy) {
+        if (shared.cb == nullptr || shared.cb != cb) {
+            WeakPtr tmp(std::move(shared));
+            swap(tmp);
+            return *this;
+        }
+        ptr = static_cast<element_type*>(shared.get());
+        shared.cb = nullptr;
+        shared.ptr = nullptr;
+        cb->releaseShared();
+        return *this;
+    }
+
+    template <typename Derived>
+    WeakPtr& operator=(const WeakPtr<Derived, Policy>& other) noexcept {
+        return assignCopy(static_cast<BaseControlBlock*>(other.cb),
+                          static_cast<element_type*>(other.ptr));
+    }
+
+    template <typename Derived>
+    WeakPtr& operator=(WeakPtr<Derived, Policy>&& other) noexcept {
+        return assignMove(other);
+    }
+
+    constexpr bool expired() const noexcept {
+        return cb == nullptr || cb->useCount() == 0;
+    }
+
+    SharedPtr<T, Policy> lock() const noexcept {
+        return SharedPtr<T, Policy>(*this);
+    }
+
+    element_type& operator*() const noexcept
+        requires(!std::is_array_v<T>)
+    {
+        return *ptr;
+    }
+    element_type* get() const noexcept {
+        return ptr;
+    }
+    element_type* operator->() const noexcept
+        requires(!std::is_array_v<T>)
+    {
+        return ptr;
+    }
+    constexpr size_t use_count() const noexcept {
+        return cb == nullptr ? 0 : cb->useCount();
+    }
 
-template <typename T>
-class EnableSharedFromThis;
+    // Calls fn with the object, or nullptr if expired, without touching the
+    // shared count; the object cannot be reclaimed until fn returns.
+    template <typename F>
+    decltype(auto) withLocked(F&& fn) const
+        requires Policy::kDeferredRelease
+    {
+        EpochGuard<Policy> guard;
+        bool alive = cb != nullptr && Policy::loadAcquire(cb->shared_cnt) != 0;
+        return std::forward<F>(fn)(alive ? ptr : nullptr);
+    }
+};
 
-template <typename T>
-class SharedPtr;
+// Every policy keeps handles at two pointers and trivially relocatable; the
+// default block is three words with nothing to destroy beyond the object.
+template <typename Policy>
+inline constexpr bool kPolicyLayoutHolds =
+    sizeof(SharedPtr<int, Policy>) == 2 * sizeof(void*) &&
+    sizeof(WeakPtr<int, Policy>) == 2 * sizeof(void*) &&
+    isTriviallyRelocatable<SharedPtr<int, Policy>> &&
+    isTriviallyRelocatable<WeakPtr<int, Policy>>;
+
+static_assert(kPolicyLayoutHolds<SingleThreadedPolicy>);
+static_assert(kPolicyLayoutHolds<AtomicPolicy>);
+static_assert(kPolicyLayoutHolds<BiasedPolicy>);
+static_assert(kPolicyLayoutHolds<PaddedPolicy<AtomicPolicy>>);
+static_assert(sizeof(BaseControlBlock<DefaultPolicy>) == 3 * sizeof(void*));
+static_assert(std::is_trivially_destructible_v<BaseControlBlock<DefaultPolicy>>);
+
+// With the default policy the accessors, copies and destructors are plain
+// loads and count updates: on empty handles they are constant expressions.
+// Any extra work on those paths, such as testing for the lazy tag, calls
+// something that is not constexpr and fails this assertion.
+static_assert([] {
+    SharedPtr<int> shared;
+    SharedPtr<int> copy = shared;
+    SharedPtr<int> moved = std::move(copy);
+    WeakPtr<int> weak;
+    WeakPtr<int> weak_copy = weak;
+    return shared.get() == nullptr && moved.get() == nullptr &&
+           moved.use_count() == 0 && weak_copy.expired() &&
+           weak_copy.use_count() == 0;
+}());
+
+template <typename T, typename Policy>
+class EnableSharedFromThis {
+    template <typename U, typename P>
+    friend class SharedPtr;
 
-struct BaseControlBlock {
-    size_t shared_cnt;
-    size_t weak_cnt;
-    BaseControlBlock(int shared_cnt, int weak_cnt)
-        : shared_cnt(shared_cnt), weak_cnt(weak_cnt) {}
-    virtual void useDeleter() = 0;
-    virtual void Destroy() = 0;
-    virtual void Deallocate() = 0;
-    virtual ~BaseControlBlock() = default;
-};
+    mutable WeakPtr<T, Policy> wptr;
 
-template <typename T>
-class SharedPtr {
+  public:
+    // The object may be reachable with a shared count of zero, for example
+    // from WeakPtr::withLocked() or from its own destructor, so the count is
+    // only raised while it is non-zero. Returns empty if the object is not
+    // owned or is being destroyed.
+    SharedPtr<T, Policy> shared_from_this() const noexcept {
+        SharedPtr<T, Policy> result;
+        if (wptr.cb != nullptr && wptr.cb->tryAddShared()) {
+            result.cb = wptr.cb;
+            result.ptr = wptr.ptr;
+        }
+        return result;
+    }
 
-    template <typename U>
-    friend class WeakPtr;
+    WeakPtr<T, Policy> weakFromThis() const noexcept {
+        return wptr;
+    }
 
-    template <typename U>
-    friend class SharedPtr;
+  protected:
+    EnableSharedFromThis() noexcept = default;
+    EnableSharedFromThis(const EnableSharedFromThis&) noexcept {}
+    EnableSharedFromThis& operator=(const EnableSharedFromThis&) noexcept {
+        return *this;
+    }
+    ~EnableSharedFromThis() = default;
+};
 
-    template <typename Deleter, typename Alloc>
-    struct ControlBlockRegular : public BaseControlBlock {
+// Non-owning reference to an object owned by SharedPtr, for passing it down a
+// call chain without touching its counts. It holds the object's address and
+// its control block, so the owning handle may be moved or reset as long as
+// some owner keeps the object alive for the borrow's lifetime; toShared()
+// takes a reference when a callee needs to keep the object. That makes it
+// two words, the size of a SharedPtr, not one: a single word could only
+// point at the owning handle, which ties the borrow to that handle staying
+// put, and the block cannot be found from an aliased or raw-owned address.
+// Release builds make no count updates for it at all. Debug builds
+// check that contract through a weak reference to the block, flagged in the
+// low bit of block. The layout is the same in every build, and copies and
+// the destructor follow the flag, so borrows may cross translation units
+// built with and without NDEBUG.
+template <typename T, typename Policy>
+class BorrowedPtr {
+    using Shared = SharedPtr<T, Policy>;
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
+
+    static constexpr uintptr_t kWitness = 1;
 
-        [[no_unique_address]] Deleter deleter;
-        [[no_unique_address]] Alloc alloc;
-        T* ptr;
+  public:
+    using element_type = typename Shared::element_type;
 
-        ControlBlockRegular(T* ptr, Deleter deleter, Alloc alloc)
-            : BaseControlBlock(1, 0),
-              deleter(deleter),
-              alloc(alloc),
-              ptr(ptr) {}
+  private:
+    element_type* ptr;
+    uintptr_t block;
 
-        void useDeleter() override {
-            deleter(ptr);
+    BaseControlBlock* cb() const noexcept {
+        return reinterpret_cast<BaseControlBlock*>(block & ~kWitness);
+    }
+
+    // The weak reference keeps the block readable after the object is gone.
+    void check() const noexcept {
+        assert((block & kWitness) == 0 || cb()->useCount() != 0);
+    }
+
+  public:
+    constexpr BorrowedPtr() noexcept : ptr(nullptr), block(0) {}
+
+    // Takes only the address the owner holds, so borrowing does not build a
+    // lazy object early.
+    BorrowedPtr(const Shared& owner) noexcept
+        : ptr(owner.resolved()),
+          block(reinterpret_cast<uintptr_t>(owner.cb)) {
+#ifndef NDEBUG
+        if (owner.cb != nullptr) {
+            owner.cb->addWeak();
+            block |= kWitness;
         }
+#endif
+    }
 
-        void Destroy() override {}
+    BorrowedPtr(const Shared&& owner) = delete;
 
-        void Deallocate() override {
-            using AllocControlBlock = typename std::allocator_traits<
-                Alloc>::template rebind_alloc<ControlBlockRegular>;
-            AllocControlBlock new_alloc = alloc;
-            std::allocator_traits<AllocControlBlock>::deallocate(new_alloc,
-                                                                 this, 1);
+    BorrowedPtr(const BorrowedPtr& other) noexcept
+        : ptr(other.ptr), block(other.block) {
+        if ((block & kWitness) != 0) {
+            cb()->addWeak();
         }
+    }
 
-        ~ControlBlockRegular() override = default;
-    };
+    BorrowedPtr(BorrowedPtr&& other) noexcept
+        : ptr(other.ptr), block(other.block) {
+        other.ptr = nullptr;
+        other.block = 0;
+    }
 
-    template <typename Alloc>
-    struct ControlBlockMakeShared : public BaseControlBlock {
+    BorrowedPtr& operator=(BorrowedPtr other) noexcept {
+        std::swap(ptr, other.ptr);
+        std::swap(block, other.block);
+        return *this;
+    }
 
-        [[no_unique_address]] Alloc alloc;
-        T data;
+    ~BorrowedPtr() {
+        if ((block & kWitness) != 0) {
+            cb()->releaseWeak();
+        }
+    }
 
-        template <typename... Args>
-        ControlBlockMakeShared(Alloc alloc, Args&&... args)
-            : BaseControlBlock(1, 0),
-              alloc(alloc),
-              data(std::forward<Args>(args)...) {}
+    Shared toShared() const noexcept {
+        Shared result;
+        if (cb() != nullptr) {
+            check();
+            cb()->addShared();
+            result.cb = cb();
+            result.ptr = ptr;
+            Shared::record(PointerEvent::Copy);
+        }
+        return result;
+    }
 
-        void useDeleter() override {}
+    size_t use_count() const noexcept {
+        if (cb() == nullptr) {
+            return 0;
+        }
+        check();
+        return cb()->useCount();
+    }
 
-        void Destroy() override {
-            std::allocator_traits<Alloc>::destroy(alloc, &data);
+    element_type& operator*() const noexcept(!Policy::kLazy)
+        requires(!std::is_array_v<T>)
+    {
+        return *get();
+    }
+    element_type* get() const noexcept(!Policy::kLazy) {
+        if (cb() == nullptr) {
+            return ptr;
         }
+        check();
+        if constexpr (Policy::kLazy && !std::is_array_v<T>) {
+            if (ptr == Shared::lazyTag()) {
+                return static_cast<typename Shared::ControlBlockLazyBase*>(
+                           cb())
+                    ->materialize();
+            }
+        }
+        return ptr;
+    }
+    element_type* operator->() const noexcept(!Policy::kLazy)
+        requires(!std::is_array_v<T>)
+    {
+        return get();
+    }
+};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<BorrowedPtr<T, Policy>> : std::true_type {};
+
+static_assert(sizeof(BorrowedPtr<int>) == 2 * sizeof(void*));
+
+// Objects derived from RefCounted know the control block that owns them, so
+// IntrusivePtr can be a single pointer. makeIntrusive keeps the counters in
+// the same allocation right in front of the object, and the block is shared
+// with SharedPtr and WeakPtr.
+template <typename Policy>
+class RefCountedBase {
+    template <typename T, typename P>
+    friend class SharedPtr;
+
+    template <typename T, typename P>
+    friend class RefCounted;
+
+    template <typename T, typename P>
+    friend class IntrusivePtr;
+
+    mutable BaseControlBlock<Policy>* cb = nullptr;
+
+  protected:
+    RefCountedBase() noexcept = default;
+    RefCountedBase(const RefCountedBase&) noexcept {}
+    RefCountedBase& operator=(const RefCountedBase&) noexcept {
+        return *this;
+    }
+    ~RefCountedBase() = default;
+};
+
+template <typename T, typename Policy>
+class RefCounted : public RefCountedBase<Policy> {
+  public:
+    IntrusivePtr<T, Policy> intrusiveFromThis() noexcept {
+        return IntrusivePtr<T, Policy>::share(static_cast<T*>(this));
+    }
 
-        void Deallocate() override {
-            using AllocControlBlock = typename std::allocator_traits<
-                Alloc>::template rebind_alloc<ControlBlockMakeShared>;
+    IntrusivePtr<const T, Policy> intrusiveFromThis() const noexcept {
+        return IntrusivePtr<const T, Policy>::share(
+            static_cast<const T*>(this));
+    }
 
-            AllocControlBlock new_alloc = alloc;
-            std::allocator_traits<AllocControlBlock>::deallocate(new_alloc,
-                                                                 this, 1);
+    WeakPtr<T, Policy> weakFromThis() noexcept {
+        WeakPtr<T, Policy> result;
+        if (this->cb != nullptr) {
+            this->cb->addWeak();
+            result.cb = this->cb;
+            result.ptr = static_cast<T*>(this);
         }
+        return result;
+    }
 
-        ~ControlBlockMakeShared() override = default;
-    };
+  protected:
+    RefCounted() noexcept = default;
+    RefCounted(const RefCounted&) noexcept = default;
+    RefCounted& operator=(const RefCounted&) noexcept = default;
+    ~RefCounted() = default;
+};
+
+template <typename T, typename Policy>
+class IntrusivePtr {
+
+    template <typename U, typename P>
+    friend class IntrusivePtr;
+
+    template <typename U, typename P>
+    friend class RefCounted;
+
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
 
-    BaseControlBlock* cb;
     T* ptr;
 
-  public:
-    SharedPtr() : cb(nullptr), ptr(nullptr) {}
+    static BaseControlBlock* blockOf(T* ptr) noexcept {
+        static_assert(std::is_base_of_v<RefCountedBase<Policy>, T>,
+                      "IntrusivePtr requires a RefCounted object");
+        return static_cast<const RefCountedBase<Policy>*>(ptr)->cb;
+    }
 
-    template <typename Deleter = std::default_delete<T>,
-              typename Alloc = std::allocator<T>>
-    SharedPtr(T* ptr, Deleter deleter = Deleter(), Alloc alloc = Alloc())
-        : cb(nullptr), ptr(ptr) {
+    // As with shared_from_this(), the object may be reachable after its last
+    // owner is gone, so the count is only raised while it is non-zero.
+    static IntrusivePtr share(T* ptr) noexcept {
+        IntrusivePtr result;
+        if (blockOf(ptr) != nullptr && blockOf(ptr)->tryAddShared()) {
+            result.ptr = ptr;
+        }
+        return result;
+    }
 
-        using AllocControlBlock = typename std::allocator_traits<
-            Alloc>::template rebind_alloc<ControlBlockRegular<Deleter, Alloc>>;
+  public:
+    constexpr IntrusivePtr() noexcept : ptr(nullptr) {}
 
-        AllocControlBlock new_alloc = alloc;
-        cb = std::allocator_traits<AllocControlBlock>::allocate(new_alloc, 1);
-        new (cb) ControlBlockRegular<Deleter, Alloc>(ptr, deleter, alloc);
+    explicit IntrusivePtr(const SharedPtr<T, Policy>& owner) noexcept(
+        !Policy::kLazy)
+        : ptr(nullptr) {
+        if (T* object = owner.get()) {
+            *this = share(object);
+        }
+    }
 
-        if constexpr (std::is_base_of_v<EnableSharedFromThis<T>, T>) {
-            ptr->wptr = *this;
+    explicit IntrusivePtr(SharedPtr<T, Policy>&& owner) noexcept(
+        !Policy::kLazy)
+        : ptr(nullptr) {
+        T* object = owner.get();
+        if (object != nullptr && blockOf(object) == owner.cb) {
+            ptr = object;
+            owner.ptr = nullptr;
+            owner.cb = nullptr;
+        } else if (object != nullptr) {
+            *this = share(object);
         }
     }
 
-    SharedPtr(const SharedPtr& other) : cb(other.cb), ptr(other.ptr) {
-        if (cb != nullptr) {
-            ++cb->shared_cnt;
+    IntrusivePtr(const IntrusivePtr& other) noexcept : ptr(other.ptr) {
+        if (ptr != nullptr) {
+            blockOf(ptr)->addShared();
         }
     }
 
-    SharedPtr(SharedPtr&& other) : cb(other.cb), ptr(other.ptr) {
+    IntrusivePtr(IntrusivePtr&& other) noexcept : ptr(other.ptr) {
         other.ptr = nullptr;
-        other.cb = nullptr;
     }
 
     template <typename Derived>
-    SharedPtr(const SharedPtr<Derived>& other)
-        : cb(static_cast<BaseControlBlock*>(other.cb)),
-          ptr(static_cast<T*>(other.ptr)) {
-        if (cb != nullptr) {
-            ++cb->shared_cnt;
+    IntrusivePtr(const IntrusivePtr<Derived, Policy>& other) noexcept
+        : ptr(static_cast<T*>(other.ptr)) {
+        if (ptr != nullptr) {
+            blockOf(ptr)->addShared();
         }
     }
 
     template <typename Derived>
-    SharedPtr(SharedPtr<Derived>&& other)
-        : cb(static_cast<BaseControlBlock*>(other.cb)),
-          ptr(static_cast<T*>(other.ptr)) {
+    IntrusivePtr(IntrusivePtr<Derived, Policy>&& other) noexcept
+        : ptr(static_cast<T*>(other.ptr)) {
         other.ptr = nullptr;
-        other.cb = nullptr;
     }
 
-    ~SharedPtr() {
-        if (cb == nullptr) {
+    ~IntrusivePtr() {
+        if (ptr == nullptr) {
             return;
         }
-        --cb->shared_cnt;
-        if (cb->shared_cnt == 0) {
-            cb->useDeleter();
-            cb->Destroy();
-            if (cb->weak_cnt == 0) {
-                cb->Deallocate();
-            }
-        }
-        cb = nullptr;
+        blockOf(ptr)->releaseShared();
         ptr = nullptr;
     }
 
-  private:
-    template <typename Alloc>
-    SharedPtr(ControlBlockMakeShared<Alloc>* cb) : cb(cb), ptr(&cb->data) {}
-
-    SharedPtr(const WeakPtr<T>& weak) : cb(weak.cb), ptr(weak.ptr) {
-        ++cb->shared_cnt;
-    }
-
-  public:
-    void swap(SharedPtr& other) {
-        std::swap(cb, other.cb);
+    void swap(IntrusivePtr& other) noexcept {
         std::swap(ptr, other.ptr);
     }
 
-    SharedPtr& operator=(const SharedPtr& other) {
-        if (this == &other) {
-            return *this;
-        }
-        SharedPtr tmp(other);
+    IntrusivePtr& operator=(const IntrusivePtr& other) noexcept {
+        IntrusivePtr tmp(other);
         swap(tmp);
         return *this;
     }
 
-    SharedPtr& operator=(SharedPtr&& other) {
-        if (this == &other) {
-            return *this;
-        }
-        SharedPtr tmp(std::move(other));
+    IntrusivePtr& operator=(IntrusivePtr&& other) noexcept {
+        IntrusivePtr tmp(std::move(other));
         swap(tmp);
         return *this;
     }
 
-    template <typename Derived>
-    SharedPtr& operator=(const SharedPtr<Derived>& other) {
-        if (static_cast<void*>(this) == static_cast<const void*>(&other)) {
-            return *this;
-        }
-        SharedPtr tmp(other);
+    void reset() noexcept {
+        IntrusivePtr tmp;
         swap(tmp);
-        return *this;
     }
 
-    template <typename Derived>
-    SharedPtr& operator=(SharedPtr<Derived>&& other) {
-        if (static_cast<void*>(this) == static_cast<void*>(&other)) {
-            return *this;
+    SharedPtr<T, Policy> toShared() const& noexcept {
+        SharedPtr<T, Policy> result;
+        if (ptr != nullptr) {
+            blockOf(ptr)->addShared();
+            result.cb = blockOf(ptr);
+            result.ptr = ptr;
         }
-        SharedPtr tmp(std::move(other));
-        swap(tmp);
-        return *this;
+        return result;
     }
 
-    template <typename Deleter = std::default_delete<T>,
-              typename Alloc = std::allocator<T>>
-    void reset(T* ptr, Deleter deleter = Deleter(), Alloc alloc = Alloc()) {
-        SharedPtr tmp(ptr, deleter, alloc);
-        swap(tmp);
-    }
-    void reset() {
-        SharedPtr tmp;
-        swap(tmp);
+    SharedPtr<T, Policy> toShared() && noexcept {
+        SharedPtr<T, Policy> result;
+        if (ptr != nullptr) {
+            result.cb = blockOf(ptr);
+            result.ptr = ptr;
+            ptr = nullptr;
+        }
+        return result;
     }
 
-    size_t use_count() const {
-        return cb->shared_cnt;
+    size_t use_count() const noexcept {
+        return ptr == nullptr ? 0 : blockOf(ptr)->useCount();
     }
 
-    template <typename U, typename... Args>
-    friend SharedPtr<U> makeShared(Args&&... args);
-
-    template <typename U, typename Alloc, typename... Args>
-    friend SharedPtr<U> allocateShared(Alloc alloc, Args&&... args);
-
-    T& operator*() const {
+    T& operator*() const noexcept {
         return *ptr;
     }
-    T* get() const {
+    T* get() const noexcept {
         return ptr;
     }
-    T* operator->() const {
+    T* operator->() const noexcept {
         return ptr;
     }
 };
 
-template <typename T, typename Alloc, typename... Args>
-SharedPtr<T> allocateShared(Alloc alloc, Args&&... args) {
-    using AllocControlBlock =
-        typename std::allocator_traits<Alloc>::template rebind_alloc<
-            typename SharedPtr<T>::template ControlBlockMakeShared<Alloc>>;
-    AllocControlBlock new_alloc = alloc;
-    auto* cb = std::allocator_traits<AllocControlBlock>::allocate(new_alloc, 1);
-    std::allocator_traits<AllocControlBlock>::construct(
-        new_alloc, cb, alloc, std::forward<Args>(args)...);
-    return SharedPtr<T>(cb);
-}
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<IntrusivePtr<T, Policy>> : std::true_type {};
 
-template <typename T, typename... Args>
-SharedPtr<T> makeShared(Args&&... args) {
+template <typename T, typename Policy = DefaultPolicy, typename Alloc,
+          typename... Args>
+IntrusivePtr<T, Policy> allocateIntrusive(Alloc alloc, Args&&... args) {
+    return IntrusivePtr<T, Policy>(
+        allocateShared<T, Policy>(alloc, std::forward<Args>(args)...));
+}
 
-    return allocateShared<T>(std::allocator<T>(), std::forward<Args>(args)...);
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+IntrusivePtr<T, Policy> makeIntrusive(Args&&... args) {
+    return allocateIntrusive<T, Policy>(std::allocator<std::remove_cv_t<T>>(),
+                                        std::forward<Args>(args)...);
 }
 
-template <typename T>
-class WeakPtr {
+// A SharedPtr in one word. When the object lives inside its make-shared block,
+// the object address is the block address plus a fixed offset, so only the
+// block is stored. Anything else (aliasing, raw-pointer ownership, casts that
+// move the pointer) is kept as an ordinary SharedPtr in a make-shared holder,
+// and the word tags the holder's block with the low bit.
+template <typename T, typename Policy>
+class CompactSharedPtr {
+    static_assert(!std::is_array_v<T>);
 
-    template <typename U>
-    friend class WeakPtr;
+    using Shared = SharedPtr<T, Policy>;
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
 
-    template <typename U>
-    friend class SharedPtr;
+    static constexpr uintptr_t kIndirect = 1;
 
-    BaseControlBlock* cb;
-    T* ptr;
+    uintptr_t word;
 
-  public:
-    WeakPtr() : cb(nullptr), ptr(nullptr) {}
-    WeakPtr(const SharedPtr<T>& shared) : cb(shared.cb), ptr(shared.ptr) {
-        ++cb->weak_cnt;
+    static size_t dataOffset() noexcept {
+        return ControlBlockLayout<T, Policy>::make_shared.data_offset;
     }
 
-    WeakPtr(SharedPtr<T>&& shared) : cb(shared.cb), ptr(shared.ptr) {
-        shared.ptr = nullptr;
-        shared.cb = nullptr;
-        --cb->shared_cnt;
-        ++cb->weak_cnt;
+    static size_t holderOffset() noexcept {
+        return ControlBlockLayout<Shared, Policy>::make_shared.data_offset;
     }
 
-    template <typename Derived>
-    WeakPtr(const SharedPtr<Derived>& shared)
-        : cb(static_cast<BaseControlBlock*>(shared.cb)),
-          ptr(static_cast<T*>(shared.ptr)) {
-        ++cb->weak_cnt;
+    BaseControlBlock* block() const noexcept {
+        return reinterpret_cast<BaseControlBlock*>(word & ~kIndirect);
     }
 
-    template <typename Derived>
-    WeakPtr(SharedPtr<Derived>&& shared)
-        : cb(static_cast<BaseControlBlock*>(shared.cb)),
-          ptr(static_cast<T*>(shared.ptr)) {
-        shared.ptr = nullptr;
-        shared.cb = nullptr;
-        --cb->shared_cnt;
-        ++cb->weak_cnt;
+    template <typename U>
+    U* at(size_t offset) const noexcept {
+        return std::launder(reinterpret_cast<U*>(
+            reinterpret_cast<char*>(block()) + offset));
     }
 
-    WeakPtr(const WeakPtr& other) : cb(other.cb), ptr(other.ptr) {
-        ++cb->weak_cnt;
+    void adopt(Shared&& shared) {
+        if (shared.cb == nullptr && shared.ptr == nullptr) {
+            word = 0;
+            return;
+        }
+        if (shared.cb != nullptr &&
+            reinterpret_cast<char*>(shared.cb) + dataOffset() ==
+                reinterpret_cast<char*>(shared.ptr)) {
+            word = reinterpret_cast<uintptr_t>(shared.cb);
+            shared.cb = nullptr;
+            shared.ptr = nullptr;
+            return;
+        }
+        // The holder must have the std::allocator layout holderOffset()
+        // assumes.
+        SharedPtr<Shared, Policy> holder = allocateShared<Shared, Policy>(
+            std::allocator<Shared>(), std::move(shared));
+        word = reinterpret_cast<uintptr_t>(holder.cb) | kIndirect;
+        holder.cb = nullptr;
+        holder.ptr = nullptr;
     }
-    WeakPtr(WeakPtr&& other) : cb(other.cb), ptr(other.ptr) {
-        other.cb = nullptr;
-        other.ptr = nullptr;
+
+  public:
+    constexpr CompactSharedPtr() noexcept : word(0) {}
+
+    explicit CompactSharedPtr(const Shared& shared) : word(0) {
+        adopt(Shared(shared));
     }
 
-    template <typename Derived>
-    WeakPtr(const WeakPtr<Derived>& shared)
-        : cb(static_cast<BaseControlBlock*>(shared.cb)),
-          ptr(static_cast<T*>(shared.ptr)) {
-        ++cb->weak_cnt;
+    explicit CompactSharedPtr(Shared&& shared) : word(0) {
+        adopt(std::move(shared));
     }
 
-    template <typename Derived>
-    WeakPtr(WeakPtr<Derived>&& shared)
-        : cb(static_cast<BaseControlBlock*>(shared.cb)),
-          ptr(static_cast<T*>(shared.ptr)) {
-        ++cb->weak_cnt;
+    CompactSharedPtr(const CompactSharedPtr& other) noexcept
+        : word(other.word) {
+        if (word != 0) {
+            block()->addShared();
+        }
     }
 
-    ~WeakPtr() {
-        if (cb == nullptr) {
+    CompactSharedPtr(CompactSharedPtr&& other) noexcept : word(other.word) {
+        other.word = 0;
+    }
+
+    ~CompactSharedPtr() {
+        if (word == 0) {
             return;
         }
-        --cb->weak_cnt;
-        if (cb->weak_cnt == 0 && cb->shared_cnt == 0) {
-            cb->Deallocate();
-        }
-        cb = nullptr;
-        ptr = nullptr;
+        block()->releaseShared();
+        word = 0;
     }
 
-    void swap(WeakPtr& other) {
-        std::swap(cb, other.cb);
-        std::swap(ptr, other.ptr);
+    void swap(CompactSharedPtr& other) noexcept {
+        std::swap(word, other.word);
     }
 
-    WeakPtr& operator=(const WeakPtr& other) {
-        WeakPtr tmp(other);
+    CompactSharedPtr& operator=(const CompactSharedPtr& other) noexcept {
+        CompactSharedPtr tmp(other);
         swap(tmp);
         return *this;
     }
 
-    WeakPtr& operator=(WeakPtr&& other) {
-        WeakPtr tmp(std::move(other));
+    CompactSharedPtr& operator=(CompactSharedPtr&& other) noexcept {
+        CompactSharedPtr tmp(std::move(other));
         swap(tmp);
         return *this;
     }
 
-    template <typename Derived>
-    WeakPtr operator=(const SharedPtr<Derived>& shared) {
-        WeakPtr tmp(shared);
+    void reset() noexcept {
+        CompactSharedPtr tmp;
         swap(tmp);
-        return *this;
     }
 
-    template <typename Derived>
-    WeakPtr operator=(SharedPtr<Derived>&& shared) {
-        WeakPtr tmp(std::move(shared));
-        swap(tmp);
-        return *this;
+    Shared toShared() const& noexcept {
+        if (word & kIndirect) {
+            return *at<Shared>(holderOffset());
+        }
+        Shared result;
+        if (word != 0) {
+            block()->addShared();
+            result.cb = block();
+            result.ptr = get();
+        }
+        return result;
     }
 
-    template <typename Derived>
-    WeakPtr operator=(const WeakPtr<Derived>& shared) {
-        WeakPtr tmp(shared);
-        swap(tmp);
-        return *this;
+    Shared toShared() && noexcept {
+        Shared result;
+        if (word & kIndirect) {
+            result = *at<Shared>(holderOffset());
+            reset();
+        } else if (word != 0) {
+            result.cb = block();
+            result.ptr = get();
+            word = 0;
+        }
+        return result;
     }
 
-    template <typename Derived>
-    WeakPtr operator=(WeakPtr<Derived>&& shared) {
-        WeakPtr tmp(std::move(shared));
-        swap(tmp);
-        return *this;
+    size_t use_count() const noexcept {
+        if (word & kIndirect) {
+            return at<Shared>(holderOffset())->use_count() - 1 +
+                   block()->useCount();
+        }
+        return word == 0 ? 0 : block()->useCount();
+    }
+
+    T& operator*() const noexcept {
+        return *get();
     }
+    T* get() const noexcept {
+        if (word & kIndirect) [[unlikely]] {
+            return at<Shared>(holderOffset())->get();
+        }
+        return word == 0 ? nullptr : at<T>(dataOffset());
+    }
+    T* operator->() const noexcept {
+        return get();
+    }
+};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<CompactSharedPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy = DefaultPolicy, typename Alloc,
+          typename... Args>
+CompactSharedPtr<T, Policy> allocateCompactShared(Alloc alloc,
+                                                  Args&&... args) {
+    return CompactSharedPtr<T, Policy>(
+        allocateShared<T, Policy>(alloc, std::forward<Args>(args)...));
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+CompactSharedPtr<T, Policy> makeCompactShared(Args&&... args) {
+    return allocateCompactShared<T, Policy>(
+        std::allocator<std::remove_cv_t<T>>(), std::forward<Args>(args)...);
+}
+
+// Lock-free atomic holder for SharedPtr<T, AtomicPolicy> using split
+// reference counts: the upper bits of the word count readers that are still
+// copying out of the current node, and whoever swaps the node out transfers
+// that count to the node's internal counter. Assumes user-space addresses
+// fit in 48 bits on 64-bit platforms.
+template <typename T>
+class AtomicSharedPtr {
+    using Value = SharedPtr<T, AtomicPolicy>;
+
+    struct Node {
+        std::atomic<std::ptrdiff_t> internal_cnt;
+        Value value;
+
+        explicit Node(Value value)
+            : internal_cnt(0), value(std::move(value)) {}
+    };
+
+    static_assert(sizeof(void*) <= sizeof(uint64_t));
+
+    static constexpr int kPointerBits = sizeof(void*) == 8 ? 48 : 32;
+    static constexpr uint64_t kPointerMask =
+        (uint64_t(1) << kPointerBits) - 1;
+    static constexpr uint64_t kLocalOne = uint64_t(1) << kPointerBits;
 
-    bool expired() const noexcept {
-        return cb == nullptr || cb->shared_cnt == 0;
+    mutable std::atomic<uint64_t> word;
+
+    static Node* nodeOf(uint64_t word) noexcept {
+        return reinterpret_cast<Node*>(
+            static_cast<uintptr_t>(word & kPointerMask));
     }
 
-    SharedPtr<T> lock() const {
-        return SharedPtr<T>(*this);
+    static uint64_t localOf(uint64_t word) noexcept {
+        return word >> kPointerBits;
     }
 
-    T& operator*() const {
-        return *ptr;
+    static uint64_t wordOf(Node* node) noexcept {
+        return reinterpret_cast<uintptr_t>(node);
     }
-    T* get() const {
-        return ptr;
+
+    static Node* makeNode(Value value) {
+        if (value.cb == nullptr && value.ptr == nullptr) {
+            return nullptr;
+        }
+        return new Node(std::move(value));
     }
-    T* operator->() const {
-        return ptr;
+
+    static bool holds(Node* node, const Value& value) noexcept {
+        if (node == nullptr) {
+            return value.cb == nullptr && value.ptr == nullptr;
+        }
+        return node->value.cb == value.cb && node->value.ptr == value.ptr;
     }
-    size_t use_count() const {
-        return cb->shared_cnt;
+
+    static void retire(uint64_t word) noexcept {
+        Node* node = nodeOf(word);
+        if (node == nullptr) {
+            return;
+        }
+        auto local = static_cast<std::ptrdiff_t>(localOf(word));
+        if (node->internal_cnt.fetch_add(local, std::memory_order_acq_rel) ==
+            -local) {
+            delete node;
+        }
     }
-};
 
-template <typename T>
-class EnableSharedFromThis {
-    WeakPtr<T> wptr;
+    Node* acquireLocal() const noexcept {
+        return nodeOf(word.fetch_add(kLocalOne, std::memory_order_acquire));
+    }
+
+    void releaseLocal(Node* node) const noexcept {
+        uint64_t current = word.load(std::memory_order_relaxed);
+        while (nodeOf(current) == node && localOf(current) != 0) {
+            if (word.compare_exchange_weak(current, current - kLocalOne,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        if (node != nullptr &&
+            node->internal_cnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete node;
+        }
+    }
 
   public:
-    SharedPtr<T> shared_from_this() const noexcept {
-        return wptr.lock();
+    static constexpr bool is_always_lock_free =
+        std::atomic<uint64_t>::is_always_lock_free;
+
+    constexpr AtomicSharedPtr() noexcept : word(0) {}
+
+    AtomicSharedPtr(Value desired)
+        : word(wordOf(makeNode(std::move(desired)))) {}
+
+    AtomicSharedPtr(const AtomicSharedPtr&) = delete;
+    AtomicSharedPtr& operator=(const AtomicSharedPtr&) = delete;
+
+    ~AtomicSharedPtr() {
+        delete nodeOf(word.load(std::memory_order_acquire));
+    }
+
+    bool is_lock_free() const noexcept {
+        return word.is_lock_free();
+    }
+
+    Value load() const {
+        Node* node = acquireLocal();
+        Value result = node == nullptr ? Value() : node->value;
+        releaseLocal(node);
+        return result;
+    }
+
+    void store(Value desired) {
+        exchange(std::move(desired));
+    }
+
+    Value exchange(Value desired) {
+        uint64_t old = word.exchange(wordOf(makeNode(std::move(desired))),
+                                     std::memory_order_acq_rel);
+        Node* node = nodeOf(old);
+        if (node == nullptr) {
+            return Value();
+        }
+        if (localOf(old) == 0) {
+            Value result = std::move(node->value);
+            delete node;
+            return result;
+        }
+        Value result = node->value;
+        retire(old);
+        return result;
+    }
+
+    // desired gets its node only once the comparison has succeeded, so a
+    // failed compare allocates nothing.
+    bool compare_exchange_strong(Value& expected, Value desired) {
+        Node* desired_node = nullptr;
+        bool made = false;
+        while (true) {
+            Node* node = acquireLocal();
+            if (!holds(node, expected)) {
+                expected = node == nullptr ? Value() : node->value;
+                releaseLocal(node);
+                delete desired_node;
+                return false;
+            }
+            if (!made) {
+                try {
+                    desired_node = makeNode(std::move(desired));
+                } catch (...) {
+                    releaseLocal(node);
+                    throw;
+                }
+                made = true;
+            }
+            uint64_t current = word.load(std::memory_order_relaxed);
+            while (nodeOf(current) == node) {
+                if (word.compare_exchange_weak(current, wordOf(desired_node),
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_relaxed)) {
+                    retire(current - kLocalOne);
+                    return true;
+                }
+            }
+            releaseLocal(node);
+        }
+    }
+
+    bool compare_exchange_weak(Value& expected, Value desired) {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+    AtomicSharedPtr& operator=(Value desired) {
+        store(std::move(desired));
+        return *this;
+    }
+
+    operator Value() const {
+        return load();
     }
 };
@@ -0,0 +1,181 @@
+#pragma once
+
+// Arena and ArenaScope, bump allocation for control blocks that are freed
+// together, and makeSharedIn.
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "smart_pointers.h"
+
+// Bump allocator behind ArenaScope. Individual frees do nothing; reset()
+// keeps the newest chunk for reuse and frees the rest, and the destructor
+// frees everything. Debug builds assert that nothing allocated is still in
+// use at either point.
+class Arena {
+    struct Chunk {
+        Chunk* next;
+        size_t size;
+    };
+
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    Chunk* chunks = nullptr;
+    uintptr_t cursor = 0;
+    uintptr_t end = 0;
+#ifndef NDEBUG
+    std::atomic<size_t> live{0};
+#endif
+
+    static uintptr_t alignUp(uintptr_t value, size_t align) noexcept {
+        return (value + align - 1) & ~uintptr_t(align - 1);
+    }
+
+    void grow(size_t size, size_t align) {
+        size_t chunk_size = sizeof(Chunk) + size + align;
+        if (chunk_size < kChunkSize) {
+            chunk_size = kChunkSize;
+        }
+        auto* chunk = static_cast<Chunk*>(::operator new(chunk_size));
+        chunk->next = chunks;
+        chunk->size = chunk_size;
+        chunks = chunk;
+        cursor = reinterpret_cast<uintptr_t>(chunk + 1);
+        end = reinterpret_cast<uintptr_t>(chunk) + chunk_size;
+    }
+
+    static void freeChunks(Chunk* chunk) noexcept {
+        while (chunk != nullptr) {
+            Chunk* next = chunk->next;
+            ::operator delete(chunk);
+            chunk = next;
+        }
+    }
+
+  public:
+    Arena() noexcept = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+#ifndef NDEBUG
+        assert(live.load() == 0 && "a SharedPtr outlived its ArenaScope");
+#endif
+        freeChunks(chunks);
+    }
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t result = alignUp(cursor, align);
+        if (chunks == nullptr || result + size > end) {
+            grow(size, align);
+            result = alignUp(cursor, align);
+        }
+        cursor = result + size;
+#ifndef NDEBUG
+        live.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return reinterpret_cast<void*>(result);
+    }
+
+    void deallocate(void*) noexcept {
+#ifndef NDEBUG
+        live.fetch_sub(1, std::memory_order_relaxed);
+#endif
+    }
+
+    void reset() noexcept {
+#ifndef NDEBUG
+        assert(live.load() == 0 && "a SharedPtr outlived its ArenaScope");
+#endif
+        if (chunks == nullptr) {
+            return;
+        }
+        freeChunks(chunks->next);
+        chunks->next = nullptr;
+        cursor = reinterpret_cast<uintptr_t>(chunks + 1);
+        end = reinterpret_cast<uintptr_t>(chunks) + chunks->size;
+    }
+};
+
+template <typename T>
+class ArenaAllocator {
+    template <typename U>
+    friend class ArenaAllocator;
+
+    Arena* arena;
+
+  public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) noexcept : arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) noexcept {
+        arena->deallocate(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept {
+        return arena == other.arena;
+    }
+};
+
+// An arena for one request: makeSharedIn(scope.arena(), ...) carves blocks
+// from it, and it is freed (or, for an arena passed in, reset for reuse) when
+// the scope ends. Every pointer made in it, weak ones included, must be gone
+// by then.
+class ArenaScope {
+    Arena owned;
+    Arena* target;
+
+  public:
+    ArenaScope() noexcept : target(&owned) {}
+
+    explicit ArenaScope(Arena& arena) noexcept : target(&arena) {}
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+    ~ArenaScope() {
+        if (target != &owned) {
+            target->reset();
+        }
+    }
+
+    Arena& arena() noexcept {
+        return *target;
+    }
+};
+
+// Blocks queued by a deferred policy are freed after their last SharedPtr,
+// possibly after the arena is gone, so those policies cannot use one.
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+SharedPtr<T, Policy> makeSharedIn(Arena& arena, Args&&... args) {
+    static_assert(!Policy::kDeferredRelease,
+                  "deferred blocks may outlive the arena");
+    return allocateShared<T, Policy>(
+        ArenaAllocator<std::remove_cv_t<std::remove_extent_t<T>>>(arena),
+        std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = DefaultPolicy, typename... Size>
+SharedPtr<T, Policy> makeSharedForOverwriteIn(Arena& arena, Size... size) {
+    static_assert(!Policy::kDeferredRelease,
+                  "deferred blocks may outlive the arena");
+    return allocateSharedForOverwrite<T, Policy>(
+        ArenaAllocator<std::remove_cv_t<std::remove_extent_t<T>>>(arena),
+        size...);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Count updates for many SharedPtrs to one object at a time.
+
+#include <algorithm>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "smart_pointers.h"
+
+struct SharedPtrBatch {
+    template <typename T, typename Policy>
+    static std::vector<SharedPtr<T, Policy>> share(
+        const SharedPtr<T, Policy>& owner, size_t n) {
+        std::vector<SharedPtr<T, Policy>> handles(n);
+        if (owner.cb != nullptr && n != 0) {
+            owner.cb->addShared(n);
+            for (SharedPtr<T, Policy>& handle : handles) {
+                handle.cb = owner.cb;
+                handle.ptr = owner.ptr;
+            }
+        }
+        return handles;
+    }
+
+    template <typename T, typename Policy>
+    static void release(std::span<SharedPtr<T, Policy>> handles) noexcept {
+        using Block = BaseControlBlock<Policy>;
+
+        std::sort(handles.begin(), handles.end(),
+                  [](const SharedPtr<T, Policy>& lhs,
+                     const SharedPtr<T, Policy>& rhs) {
+                      return std::less<Block*>()(lhs.cb, rhs.cb);
+                  });
+        for (size_t i = 0; i < handles.size();) {
+            Block* group = handles[i].cb;
+            size_t count = 0;
+            for (; i < handles.size() && handles[i].cb == group; ++i) {
+                handles[i].cb = nullptr;
+                handles[i].ptr = nullptr;
+                ++count;
+            }
+            if (group != nullptr) {
+                group->releaseShared(count);
+            }
+        }
+    }
+};
+
+// n more owners of owner's object, with one update of the count.
+template <typename T, typename Policy>
+std::vector<SharedPtr<T, Policy>> shareBatch(const SharedPtr<T, Policy>& owner,
+                                             size_t n) {
+    return SharedPtrBatch::share(owner, n);
+}
+
+// Empties every handle, dropping all references to a block at once.
+// The handles are reordered by control block in the process.
+template <typename T, typename Policy>
+void releaseBatch(std::span<SharedPtr<T, Policy>> handles) noexcept {
+    SharedPtrBatch::release(handles);
+}
+
+template <typename T, typename Policy>
+void releaseBatch(std::vector<SharedPtr<T, Policy>>& handles) noexcept {
+    SharedPtrBatch::release(std::span(handles));
+}
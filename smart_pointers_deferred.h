@@ -0,0 +1,228 @@
+#pragma once
+
+// DeferredPolicy and what it runs on: the queue of retired blocks, the epoch
+// guards behind WeakPtr::withLocked(), and a background reclaimer.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "smart_pointers.h"
+
+// Atomic counting, but an object whose last SharedPtr goes away is queued
+// instead of destroyed; drainDeferred() or a DeferredReclaimer frees it later.
+struct DeferredPolicy : AtomicPolicy {
+    static constexpr bool kDeferredRelease = true;
+};
+
+static_assert(SharedPtrPolicy<DeferredPolicy>);
+static_assert(kPolicyLayoutHolds<DeferredPolicy>);
+
+// Blocks whose shared count reached zero under a deferred policy. Producers
+// push with a CAS; a drain detaches the whole list at once, so there is no
+// single-node pop and no ABA. Detached blocks are stamped with the epoch they
+// were retired in and disposed only once every reader pinned at or before that
+// epoch has unpinned. Destructors run by a drain may queue more blocks, which
+// the same drain picks up.
+template <typename Policy>
+struct DeferredQueue {
+    using Block = BaseControlBlock<Policy>;
+
+    // One per thread that has ever pinned; records are reused, never freed.
+    struct Reader {
+        std::atomic<uint64_t> pinned{0};
+        std::atomic<bool> in_use{true};
+        size_t depth = 0;
+        Reader* next = nullptr;
+    };
+
+    struct ReaderSlot {
+        Reader* reader;
+
+        ReaderSlot() : reader(acquireReader()) {}
+        ~ReaderSlot() {
+            reader->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    static inline std::atomic<Block*> head{nullptr};
+    static inline std::atomic<uint64_t> epoch{1};
+    static inline std::atomic<Reader*> readers{nullptr};
+    static inline std::mutex drain_mutex;
+    static inline Block* limbo_head = nullptr;
+    static inline Block* limbo_tail = nullptr;
+
+    static Reader* acquireReader() {
+        for (Reader* r = readers.load(std::memory_order_acquire); r != nullptr;
+             r = r->next) {
+            bool free = false;
+            if (r->in_use.compare_exchange_strong(free, true,
+                                                  std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        Reader* r = new Reader;
+        Reader* top = readers.load(std::memory_order_relaxed);
+        do {
+            r->next = top;
+        } while (!readers.compare_exchange_weak(top, r,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+        return r;
+    }
+
+    static Reader& localReader() {
+        thread_local ReaderSlot slot;
+        return *slot.reader;
+    }
+
+    static void pin() {
+        Reader& r = localReader();
+        if (r.depth++ == 0) {
+            r.pinned.store(epoch.load());
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    static void unpin() noexcept {
+        Reader& r = localReader();
+        if (--r.depth == 0) {
+            r.pinned.store(0, std::memory_order_release);
+        }
+    }
+
+    static uint64_t oldestPinned() noexcept {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (Reader* r = readers.load(std::memory_order_acquire); r != nullptr;
+             r = r->next) {
+            uint64_t pinned = r->pinned.load();
+            if (pinned != 0 && pinned < oldest) {
+                oldest = pinned;
+            }
+        }
+        return oldest;
+    }
+
+    static void push(Block* cb) noexcept {
+        Block* top = head.load(std::memory_order_relaxed);
+        do {
+            cb->deferred.next = top;
+        } while (!head.compare_exchange_weak(top, cb,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+
+    static void retire(Block* batch) noexcept {
+        uint64_t stamp = epoch.fetch_add(1);
+        while (batch != nullptr) {
+            Block* next = batch->deferred.next;
+            batch->deferred = {nullptr, stamp};
+            if (limbo_tail == nullptr) {
+                limbo_head = batch;
+            } else {
+                limbo_tail->deferred.next = batch;
+            }
+            limbo_tail = batch;
+            batch = next;
+        }
+    }
+
+    static size_t drain() noexcept {
+        thread_local bool draining = false;
+        if (draining) {
+            return 0;
+        }
+        std::lock_guard lock(drain_mutex);
+        draining = true;
+        size_t count = 0;
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            if (Block* batch = head.exchange(nullptr,
+                                             std::memory_order_acquire)) {
+                retire(batch);
+            }
+            uint64_t oldest = oldestPinned();
+            while (limbo_head != nullptr &&
+                   limbo_head->deferred.epoch < oldest) {
+                Block* cb = limbo_head;
+                limbo_head = cb->deferred.next;
+                if (limbo_head == nullptr) {
+                    limbo_tail = nullptr;
+                }
+                cb->dispose();
+                ++count;
+                progress = true;
+            }
+        }
+        draining = false;
+        return count;
+    }
+};
+
+// Pins the calling thread's epoch: no block retired while it is alive is
+// disposed until it is destroyed. Guards nest.
+template <typename Policy = DeferredPolicy>
+class EpochGuard {
+  public:
+    EpochGuard() {
+        DeferredQueue<Policy>::pin();
+    }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+    ~EpochGuard() {
+        DeferredQueue<Policy>::unpin();
+    }
+};
+
+template <typename Policy = DeferredPolicy>
+size_t drainDeferred() noexcept {
+    static_assert(Policy::kDeferredRelease);
+    return DeferredQueue<Policy>::drain();
+}
+
+// Background thread that drains the deferred queue every period and once
+// more on destruction.
+template <typename Policy = DeferredPolicy>
+class DeferredReclaimer {
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread thread;
+
+    void run(std::chrono::microseconds period) {
+        std::unique_lock lock(mutex);
+        while (!wakeup.wait_for(lock, period, [this] { return stopping; })) {
+            lock.unlock();
+            drainDeferred<Policy>();
+            lock.lock();
+        }
+    }
+
+  public:
+    explicit DeferredReclaimer(
+        std::chrono::microseconds period = std::chrono::milliseconds(1))
+        : thread([this, period] { run(period); }) {}
+
+    DeferredReclaimer(const DeferredReclaimer&) = delete;
+    DeferredReclaimer& operator=(const DeferredReclaimer&) = delete;
+
+    ~DeferredReclaimer() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+        drainDeferred<Policy>();
+    }
+};
+
+template <typename T, typename... Args>
+SharedPtr<T, DeferredPolicy> makeSharedDeferred(Args&&... args) {
+    return makeShared<T, DeferredPolicy>(std::forward<Args>(args)...);
+}
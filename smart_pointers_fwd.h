@@ -0,0 +1,66 @@
+#pragma once
+
+// Declarations of the policies and pointer templates, for headers that only
+// name the types. Nothing here pulls in the standard library. Include
+// smart_pointers.h to create or use the pointers, and the header next to it
+// for the optional parts: smart_pointers_deferred.h for DeferredPolicy,
+// smart_pointers_stats.h for InstrumentedPolicy, smart_pointers_tracking.h
+// for TrackedPolicy, smart_pointers_lazy.h for LazyPolicy, and
+// smart_pointers_pool.h, smart_pointers_arena.h, smart_pointers_recycling.h
+// and smart_pointers_batch.h.
+
+struct SingleThreadedPolicy;
+struct AtomicPolicy;
+struct DeferredPolicy;
+struct BiasedPolicy;
+
+template <typename Policy>
+struct PaddedPolicy;
+
+template <typename Policy>
+struct InstrumentedPolicy;
+
+template <typename Policy>
+struct TrackedPolicy;
+
+template <typename Policy>
+struct LazyPolicy;
+
+using DefaultPolicy = SingleThreadedPolicy;
+
+template <typename T, typename Policy = DefaultPolicy>
+class WeakPtr;
+
+template <typename T, typename Policy = DefaultPolicy>
+class EnableSharedFromThis;
+
+template <typename T, typename Policy = DefaultPolicy>
+class SharedPtr;
+
+template <typename T>
+class AtomicSharedPtr;
+
+// The default deleter, std::default_delete, is added by smart_pointers.h.
+template <typename T, typename Deleter>
+class UniquePtr;
+
+template <typename T, typename Policy = DefaultPolicy>
+class RefCounted;
+
+template <typename T, typename Policy = DefaultPolicy>
+class IntrusivePtr;
+
+template <typename T, typename Policy = DefaultPolicy>
+class CompactSharedPtr;
+
+template <typename T, typename Policy = DefaultPolicy>
+class BorrowedPtr;
+
+// Reset hook for RecyclingPool that hands objects back unchanged.
+struct NoReset {
+    template <typename T>
+    void operator()(T&) const noexcept {}
+};
+
+template <typename T, typename Policy = DefaultPolicy, typename Reset = NoReset>
+class RecyclingPool;
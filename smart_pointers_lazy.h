@@ -0,0 +1,177 @@
+#pragma once
+
+// LazyPolicy and makeSharedLazy, for objects built on first access.
+
+#include <atomic>
+#include <mutex>
+#include <tuple>
+
+#include "smart_pointers.h"
+
+// Same counting as Policy, but handles may point at an object that
+// makeSharedLazy has not built yet; see ControlBlockLazyBase. Only these
+// handles pay for the check in get().
+//
+// This is a trade-off: a lazy handle is SharedPtr<T, LazyPolicy<P>>, not
+// SharedPtr<T, P>, and like any two policies the two do not convert. Code
+// that stores or takes SharedPtr<T> has to name the lazy policy to hold a
+// lazy object. The alternative, a tag check in every SharedPtr<T>::get(),
+// would put a compare and a call into the hot path of handles that are never
+// lazy.
+template <typename Policy>
+struct LazyPolicy : Policy {
+    static constexpr bool kLazy = true;
+};
+
+// Until a lazy object is built, handles to it hold SharedPtr::lazyTag()
+// instead of its address. get() spots the tag and builds the object through
+// the block's once flag. The saved arguments are passed as lvalues, so if the
+// constructor throws, the exception leaves get() and the next get() tries
+// again with the same arguments. Copies of a handle take the address once the object
+// exists; conversions to another element type or to WeakPtr build it first.
+template <typename Object, typename Policy>
+struct ControlBlockLazyBase : public BaseControlBlock<Policy> {
+    using Build = void (*)(ControlBlockLazyBase*);
+
+    Build build;
+    Object* address = nullptr;
+    std::once_flag once;
+    std::atomic<bool> built = false;
+
+    ControlBlockLazyBase(typename BaseControlBlock<Policy>::Manager manager,
+                         Build build)
+        : BaseControlBlock<Policy>(manager, 1, 1), build(build) {}
+
+    Object* builtAddress() const noexcept {
+        return built.load(std::memory_order_acquire) ? address : nullptr;
+    }
+
+    Object* materialize() {
+        if (!built.load(std::memory_order_acquire)) {
+            std::call_once(once, build, this);
+        }
+        return address;
+    }
+};
+
+template <typename Object, typename Policy, typename Alloc, typename... Args>
+struct ControlBlockLazy : public ControlBlockLazyBase<Object, Policy> {
+    using Base = BaseControlBlock<Policy>;
+    using LazyBase = ControlBlockLazyBase<Object, Policy>;
+    using Action = typename Base::Action;
+    using AllocObject =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Object>;
+
+    [[no_unique_address]] AllocObject alloc;
+    union {
+        std::tuple<Args...> args;
+    };
+    union {
+        Object data;
+    };
+
+    template <typename... Params>
+    ControlBlockLazy(const Alloc& alloc, Params&&... params)
+        : LazyBase(&manage, &build), alloc(alloc) {
+        ::new (static_cast<void*>(std::addressof(args)))
+            std::tuple<Args...>(std::forward<Params>(params)...);
+        this->address = object();
+    }
+
+    Object* object() noexcept {
+        return std::addressof(data);
+    }
+
+    ~ControlBlockLazy() {}
+
+    // Handles start out holding the tag, not the object's address.
+    template <typename T, typename... Params>
+    static SharedPtr<T, Policy> create(const Alloc& alloc, Params&&... params) {
+        using AllocBlock = typename std::allocator_traits<
+            Alloc>::template rebind_alloc<ControlBlockLazy>;
+        AllocBlock new_alloc = alloc;
+        ControlBlockLazy* block =
+            std::allocator_traits<AllocBlock>::allocate(new_alloc, 1);
+        try {
+            std::allocator_traits<AllocBlock>::construct(
+                new_alloc, block, alloc, std::forward<Params>(params)...);
+        } catch (...) {
+            std::allocator_traits<AllocBlock>::deallocate(new_alloc, block, 1);
+            throw;
+        }
+        SharedPtr<T, Policy> result;
+        result.cb = block;
+        result.ptr = SharedPtr<T, Policy>::lazyTag();
+        SharedPtr<T, Policy>::record(PointerEvent::MakeShared);
+        return result;
+    }
+
+    // The saved arguments are dropped once the object exists. Until then
+    // they are only lent to the constructor, never moved from.
+    static void build(LazyBase* base) {
+        auto* cb = static_cast<ControlBlockLazy*>(base);
+        std::apply(
+            [cb](Args&... args) {
+                std::allocator_traits<AllocObject>::construct(
+                    cb->alloc, cb->object(), args...);
+            },
+            cb->args);
+        cb->args.~tuple();
+        SharedPtr<Object, Policy>::adoptBuilt(cb, cb->object());
+        cb->built.store(true, std::memory_order_release);
+    }
+
+    static void manage(Base* base, Action action) noexcept {
+        auto* cb = static_cast<ControlBlockLazy*>(base);
+        if (action != Action::Deallocate) {
+            recordEvent<Object, Policy>(PointerEvent::Destroy);
+            cb->Destroy();
+        }
+        if (action != Action::Destroy) {
+            cb->Deallocate();
+        }
+    }
+
+    void Destroy() {
+        if (this->built.load(std::memory_order_relaxed)) {
+            std::allocator_traits<AllocObject>::destroy(alloc, object());
+        } else {
+            args.~tuple();
+        }
+    }
+
+    void Deallocate() {
+        using AllocBlock = typename std::allocator_traits<
+            Alloc>::template rebind_alloc<ControlBlockLazy>;
+
+        AllocBlock block_alloc(std::move(alloc));
+        this->~ControlBlockLazy();
+        std::allocator_traits<AllocBlock>::deallocate(block_alloc, this, 1);
+    }
+};
+
+// Saves copies of args and builds the object from them, as lvalues, on the
+// first get(). Exceptions from the constructor come out of that get(); the
+// next one tries again.
+template <typename T, typename Policy = LazyPolicy<DefaultPolicy>,
+          typename Alloc, typename... Args>
+    requires(!std::is_array_v<T>)
+SharedPtr<T, Policy> allocateSharedLazy(Alloc alloc, Args&&... args) {
+    static_assert(Policy::kLazy, "lazy objects need a LazyPolicy");
+    static_assert(std::is_constructible_v<T, std::decay_t<Args>&...>,
+                  "lazy objects are built from lvalues of the saved arguments");
+    using Block = ControlBlockLazy<std::remove_cv_t<T>, Policy, Alloc,
+                                   std::decay_t<Args>...>;
+    return Block::template create<T>(alloc, std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = LazyPolicy<DefaultPolicy>,
+          typename... Args>
+    requires(!std::is_array_v<T>)
+SharedPtr<T, Policy> makeSharedLazy(Args&&... args) {
+    return allocateSharedLazy<T, Policy>(std::allocator<std::remove_cv_t<T>>(),
+                                         std::forward<Args>(args)...);
+}
+
+static_assert(SharedPtrPolicy<LazyPolicy<AtomicPolicy>>);
+static_assert(kPolicyLayoutHolds<LazyPolicy<AtomicPolicy>>);
@@ -0,0 +1,243 @@
+#pragma once
+
+// PoolAllocator, a size-class pool for control blocks, and makeSharedPooled.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#include "smart_pointers.h"
+
+// Size-class pool behind PoolAllocator. Each thread keeps a free list per
+// size class and exchanges whole batches with a global pool, so the lock is
+// only taken once per kBatchSize allocations. Slabs carved for the pool are
+// kept for the lifetime of the process.
+class SizeClassPool {
+    struct FreeNode {
+        FreeNode* next;
+        // Links full batches in the global pool, through their first nodes.
+        FreeNode* next_batch;
+    };
+
+    struct Batch {
+        FreeNode* head;
+        size_t count;
+    };
+
+    static constexpr size_t kGranularity = alignof(std::max_align_t);
+    static constexpr size_t kClasses = 16;
+    static constexpr size_t kBatchSize = 64;
+
+    static_assert(sizeof(FreeNode) <= kGranularity);
+
+    struct ThreadCache {
+        FreeNode* heads[kClasses];
+        size_t counts[kClasses];
+        bool exiting;
+    };
+
+    struct CacheFlusher {
+        ThreadCache* cache;
+
+        ~CacheFlusher() {
+            for (size_t cls = 0; cls < kClasses; ++cls) {
+                if (cache->heads[cls] != nullptr) {
+                    pushGlobal(cls, {cache->heads[cls], cache->counts[cls]});
+                    cache->heads[cls] = nullptr;
+                    cache->counts[cls] = 0;
+                }
+            }
+            cache->exiting = true;
+        }
+    };
+
+    // Unlike std::mutex, taking it cannot throw, so deallocate() can hand
+    // batches back from its noexcept path. It is held for a few stores.
+    class SpinLock {
+        std::atomic_flag flag;
+
+      public:
+        void lock() noexcept {
+            while (flag.test_and_set(std::memory_order_acquire)) {
+                while (flag.test(std::memory_order_relaxed)) {
+                }
+            }
+        }
+
+        void unlock() noexcept {
+            flag.clear(std::memory_order_release);
+        }
+    };
+
+    // Full batches are linked through their first nodes, and the nodes of
+    // partial batches are spliced onto one loose list, so returning nodes
+    // needs no storage beyond the nodes themselves.
+    struct GlobalClass {
+        FreeNode* full = nullptr;
+        FreeNode* loose = nullptr;
+        size_t loose_count = 0;
+    };
+
+    struct GlobalPool {
+        SpinLock lock;
+        GlobalClass classes[kClasses];
+    };
+
+    static GlobalPool& globalPool() {
+        static GlobalPool* pool = new GlobalPool();
+        return *pool;
+    }
+
+    static ThreadCache& threadCache() noexcept {
+        static thread_local ThreadCache cache{};
+        static thread_local CacheFlusher flusher{&cache};
+        return cache;
+    }
+
+    static size_t classSize(size_t cls) noexcept {
+        return (cls + 1) * kGranularity;
+    }
+
+    // The pool exists by now: the nodes came from popGlobal().
+    static void pushGlobal(size_t cls, Batch batch) noexcept {
+        GlobalPool& pool = globalPool();
+        GlobalClass& global = pool.classes[cls];
+        if (batch.count == kBatchSize) {
+            std::lock_guard<SpinLock> lock(pool.lock);
+            batch.head->next_batch = global.full;
+            global.full = batch.head;
+            return;
+        }
+        FreeNode* tail = batch.head;
+        while (tail->next != nullptr) {
+            tail = tail->next;
+        }
+        std::lock_guard<SpinLock> lock(pool.lock);
+        tail->next = global.loose;
+        global.loose = batch.head;
+        global.loose_count += batch.count;
+    }
+
+    static Batch popGlobal(size_t cls) {
+        GlobalPool& pool = globalPool();
+        {
+            std::lock_guard<SpinLock> lock(pool.lock);
+            GlobalClass& global = pool.classes[cls];
+            if (global.full != nullptr) {
+                FreeNode* head = global.full;
+                global.full = head->next_batch;
+                return {head, kBatchSize};
+            }
+            if (global.loose != nullptr) {
+                Batch batch{global.loose, global.loose_count};
+                global.loose = nullptr;
+                global.loose_count = 0;
+                return batch;
+            }
+        }
+        char* slab = static_cast<char*>(
+            ::operator new(classSize(cls) * kBatchSize));
+        FreeNode* head = nullptr;
+        for (size_t i = kBatchSize; i > 0; --i) {
+            auto* node = reinterpret_cast<FreeNode*>(slab +
+                                                     (i - 1) * classSize(cls));
+            node->next = head;
+            head = node;
+        }
+        return {head, kBatchSize};
+    }
+
+  public:
+    static constexpr size_t kMaxSize = kClasses * kGranularity;
+
+    static void* allocate(size_t size, size_t align) {
+        if (size > kMaxSize || align > kGranularity) {
+            return ::operator new(size, std::align_val_t(align));
+        }
+        size_t cls = size == 0 ? 0 : (size - 1) / kGranularity;
+        ThreadCache& cache = threadCache();
+        if (cache.exiting) {
+            Batch batch = popGlobal(cls);
+            FreeNode* node = batch.head;
+            batch.head = node->next;
+            if (--batch.count != 0) {
+                pushGlobal(cls, batch);
+            }
+            return node;
+        }
+        if (cache.heads[cls] == nullptr) {
+            Batch batch = popGlobal(cls);
+            cache.heads[cls] = batch.head;
+            cache.counts[cls] = batch.count;
+        }
+        FreeNode* node = cache.heads[cls];
+        cache.heads[cls] = node->next;
+        --cache.counts[cls];
+        return node;
+    }
+
+    static void deallocate(void* ptr, size_t size, size_t align) noexcept {
+        if (size > kMaxSize || align > kGranularity) {
+            ::operator delete(ptr, size, std::align_val_t(align));
+            return;
+        }
+        size_t cls = size == 0 ? 0 : (size - 1) / kGranularity;
+        auto* node = static_cast<FreeNode*>(ptr);
+        ThreadCache& cache = threadCache();
+        if (cache.exiting) {
+            node->next = nullptr;
+            pushGlobal(cls, {node, 1});
+            return;
+        }
+        node->next = cache.heads[cls];
+        cache.heads[cls] = node;
+        if (++cache.counts[cls] < 2 * kBatchSize) {
+            return;
+        }
+        FreeNode* tail = node;
+        for (size_t i = 1; i < kBatchSize; ++i) {
+            tail = tail->next;
+        }
+        cache.heads[cls] = tail->next;
+        cache.counts[cls] -= kBatchSize;
+        tail->next = nullptr;
+        pushGlobal(cls, {node, kBatchSize});
+    }
+};
+
+template <typename T>
+class PoolAllocator {
+  public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(
+            SizeClassPool::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        SizeClassPool::deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+template <typename T, typename Policy = DefaultPolicy, typename... Args>
+SharedPtr<T, Policy> makeSharedPooled(Args&&... args) {
+    return allocateShared<T, Policy>(
+        PoolAllocator<std::remove_cv_t<std::remove_extent_t<T>>>(),
+        std::forward<Args>(args)...);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+// RecyclingPool, which keeps released objects and their blocks for reuse.
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+#include "smart_pointers.h"
+
+// Hands out SharedPtrs to objects that, when the last reference drops, are
+// reset and kept together with their control block for the next acquire(),
+// which then neither allocates nor constructs. Free nodes sit on a Treiber
+// stack whose head carries a 16-bit tag above the 48 address bits, so a pop
+// racing with a pop and push of the same node fails its CAS. Nodes are freed
+// only with the pool, which must outlive every pointer it handed out.
+template <typename T, typename Policy, typename Reset>
+class RecyclingPool {
+    static_assert(!std::is_array_v<T> && !std::is_const_v<T>);
+    static_assert(!std::is_base_of_v<RefCountedBase<Policy>, T> &&
+                      !requires(const T& object) { object.weakFromThis(); },
+                  "recycled objects cannot refer to their own block");
+    static_assert(sizeof(uintptr_t) == 8, "the free list tags 64-bit pointers");
+
+    using BaseControlBlock = ::BaseControlBlock<Policy>;
+    using Action = typename BaseControlBlock::Action;
+
+    struct Node;
+
+    struct Block : public BaseControlBlock {
+        Node* node;
+
+        explicit Block(Node* node)
+            : BaseControlBlock(&manage, 1, 1), node(node) {}
+    };
+
+    // The block is built afresh for every acquire; the object is built once.
+    struct Node {
+        RecyclingPool* pool;
+        std::atomic<Node*> next{nullptr};
+        union {
+            Block block;
+        };
+        union {
+            T data;
+        };
+
+        explicit Node(RecyclingPool* pool) noexcept : pool(pool) {}
+        ~Node() {}
+    };
+
+    static constexpr int kTagShift = 48;
+    static constexpr uintptr_t kAddressMask = (uintptr_t(1) << kTagShift) - 1;
+
+    std::atomic<uintptr_t> free_head{0};
+    [[no_unique_address]] Reset reset;
+#ifndef NDEBUG
+    std::atomic<size_t> nodes{0};
+#endif
+
+    static Node* nodeOf(uintptr_t head) noexcept {
+        return reinterpret_cast<Node*>(head & kAddressMask);
+    }
+
+    static uintptr_t nextTag(uintptr_t head) noexcept {
+        return (head & ~kAddressMask) + (uintptr_t(1) << kTagShift);
+    }
+
+    static void manage(BaseControlBlock* base, Action action) noexcept {
+        Node* node = static_cast<Block*>(base)->node;
+        if (action != Action::Deallocate) {
+            node->pool->reset(node->data);
+        }
+        if (action != Action::Destroy) {
+            node->block.~Block();
+            node->pool->push(node);
+        }
+    }
+
+    void push(Node* node) noexcept {
+        uintptr_t head = free_head.load(std::memory_order_relaxed);
+        do {
+            node->next.store(nodeOf(head), std::memory_order_relaxed);
+        } while (!free_head.compare_exchange_weak(
+            head, reinterpret_cast<uintptr_t>(node) | nextTag(head),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // A popped node may already be back in use by another thread when its
+    // next link is read; the tag makes the CAS fail in that case.
+    Node* pop() noexcept {
+        uintptr_t head = free_head.load(std::memory_order_acquire);
+        while (Node* node = nodeOf(head)) {
+            uintptr_t next =
+                reinterpret_cast<uintptr_t>(
+                    node->next.load(std::memory_order_relaxed)) |
+                nextTag(head);
+            if (free_head.compare_exchange_weak(head, next,
+                                                std::memory_order_acquire,
+                                                std::memory_order_acquire)) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename... Args>
+    Node* create(Args&&... args) {
+        auto* node = new Node(this);
+        try {
+            ::new (static_cast<void*>(std::addressof(node->data)))
+                T(std::forward<Args>(args)...);
+        } catch (...) {
+            delete node;
+            throw;
+        }
+#ifndef NDEBUG
+        nodes.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return node;
+    }
+
+  public:
+    explicit RecyclingPool(Reset reset = Reset()) : reset(std::move(reset)) {}
+    RecyclingPool(const RecyclingPool&) = delete;
+    RecyclingPool& operator=(const RecyclingPool&) = delete;
+
+    ~RecyclingPool() {
+        while (Node* node = pop()) {
+            node->data.~T();
+            delete node;
+#ifndef NDEBUG
+            nodes.fetch_sub(1, std::memory_order_relaxed);
+#endif
+        }
+#ifndef NDEBUG
+        assert(nodes.load() == 0 && "a SharedPtr outlived its RecyclingPool");
+#endif
+    }
+
+    // Builds count objects up front so later acquires find them free.
+    template <typename... Args>
+    void reserve(size_t count, const Args&... args) {
+        for (size_t i = 0; i < count; ++i) {
+            push(create(args...));
+        }
+    }
+
+    // Returns a recycled object if one is free; args only build new ones.
+    template <typename... Args>
+    SharedPtr<T, Policy> acquire(Args&&... args) {
+        Node* node = pop();
+        if (node == nullptr) {
+            node = create(std::forward<Args>(args)...);
+        }
+        ::new (static_cast<void*>(std::addressof(node->block))) Block(node);
+        SharedPtr<T, Policy> result;
+        result.cb = std::addressof(node->block);
+        result.ptr = std::addressof(node->data);
+        return result;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+// InstrumentedPolicy and the per-type statistics it records.
+
+#include <atomic>
+#include <cstdint>
+#include <typeinfo>
+
+#include "smart_pointers.h"
+
+struct PointerStats {
+    uint64_t make_shared = 0;
+    uint64_t raw = 0;
+    uint64_t destroyed = 0;
+    uint64_t copies = 0;
+    uint64_t moves = 0;
+    uint64_t lock_hits = 0;
+    uint64_t lock_misses = 0;
+    int64_t live = 0;
+    int64_t peak_live = 0;
+};
+
+// Events recorded by SharedPtrs under an instrumented policy, kept per object
+// type. Each thread bumps its own counters without locked instructions;
+// snapshots add them up. Only the live count is shared, so that its peak is
+// exact. Slots stay allocated after their thread exits, keeping its totals.
+class PointerStatsRegistry {
+    struct Type {
+        const char* name;
+        PointerStats (*snapshot)();
+        Type* next;
+    };
+
+    static inline std::atomic<Type*> types{nullptr};
+
+    static void add(Type* type) noexcept {
+        Type* top = types.load(std::memory_order_relaxed);
+        do {
+            type->next = top;
+        } while (!types.compare_exchange_weak(top, type,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+    }
+
+  public:
+    template <typename T>
+    class Of {
+        static constexpr size_t kEvents = size_t(PointerEvent::Count);
+
+        struct Slot {
+            std::atomic<uint64_t> counts[kEvents] = {};
+            Slot* next = nullptr;
+        };
+
+        static inline std::atomic<Slot*> slots{nullptr};
+        static inline std::atomic<int64_t> live{0};
+        static inline std::atomic<int64_t> peak{0};
+
+        static Slot* addSlot() {
+            static Type type{typeid(T).name(), &snapshot, nullptr};
+            static const bool registered = (add(&type), true);
+            (void)registered;
+            Slot* slot = new Slot;
+            Slot* top = slots.load(std::memory_order_relaxed);
+            do {
+                slot->next = top;
+            } while (!slots.compare_exchange_weak(top, slot,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+            return slot;
+        }
+
+        static void addLive(int64_t delta) noexcept {
+            int64_t now =
+                live.fetch_add(delta, std::memory_order_relaxed) + delta;
+            int64_t top = peak.load(std::memory_order_relaxed);
+            while (now > top && !peak.compare_exchange_weak(
+                                    top, now, std::memory_order_relaxed)) {
+            }
+        }
+
+      public:
+        static void record(PointerEvent event) {
+            thread_local Slot* slot = addSlot();
+            std::atomic<uint64_t>& count = slot->counts[size_t(event)];
+            count.store(count.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+            if (event == PointerEvent::MakeShared ||
+                event == PointerEvent::Raw) {
+                addLive(1);
+            } else if (event == PointerEvent::Destroy) {
+                addLive(-1);
+            }
+        }
+
+        static PointerStats snapshot() {
+            uint64_t totals[kEvents] = {};
+            for (Slot* slot = slots.load(std::memory_order_acquire);
+                 slot != nullptr; slot = slot->next) {
+                for (size_t i = 0; i < kEvents; ++i) {
+                    totals[i] +=
+                        slot->counts[i].load(std::memory_order_relaxed);
+                }
+            }
+            PointerStats stats;
+            stats.make_shared = totals[size_t(PointerEvent::MakeShared)];
+            stats.raw = totals[size_t(PointerEvent::Raw)];
+            stats.destroyed = totals[size_t(PointerEvent::Destroy)];
+            stats.copies = totals[size_t(PointerEvent::Copy)];
+            stats.moves = totals[size_t(PointerEvent::Move)];
+            stats.lock_hits = totals[size_t(PointerEvent::LockHit)];
+            stats.lock_misses = totals[size_t(PointerEvent::LockMiss)];
+            stats.live = live.load(std::memory_order_relaxed);
+            stats.peak_live = peak.load(std::memory_order_relaxed);
+            return stats;
+        }
+    };
+
+    // Calls fn(name, stats) for every type that has recorded an event.
+    template <typename F>
+    static void forEach(F&& fn) {
+        for (Type* type = types.load(std::memory_order_acquire);
+             type != nullptr; type = type->next) {
+            fn(type->name, type->snapshot());
+        }
+    }
+};
+
+template <typename T>
+PointerStats pointerStats() {
+    return PointerStatsRegistry::Of<std::remove_cv_t<T>>::snapshot();
+}
+
+// Same counting as Policy, plus per-type statistics; see PointerStats.
+template <typename Policy>
+struct InstrumentedPolicy : Policy {
+    static constexpr bool kInstrumented = true;
+
+    template <typename Object>
+    static void record(PointerEvent event) {
+        PointerStatsRegistry::Of<Object>::record(event);
+    }
+};
+
+static_assert(SharedPtrPolicy<InstrumentedPolicy<AtomicPolicy>>);
+static_assert(kPolicyLayoutHolds<InstrumentedPolicy<AtomicPolicy>>);
@@ -0,0 +1,262 @@
+#pragma once
+
+// TrackedPolicy and detectCycles(), which finds SharedPtr cycles that nothing
+// outside them owns.
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "smart_pointers.h"
+
+// Same counting as Policy, but every block is registered for detectCycles().
+template <typename Policy>
+struct TrackedPolicy : Policy {
+    static constexpr bool kTracked = true;
+};
+
+static_assert(SharedPtrPolicy<TrackedPolicy<AtomicPolicy>>);
+static_assert(kPolicyLayoutHolds<TrackedPolicy<AtomicPolicy>>);
+
+// Specialize to let detectCycles() see the SharedPtrs an object owns:
+//     template <> struct SharedPtrFields<Node> {
+//         template <typename F>
+//         static void forEach(const Node& node, F&& fn) { fn(node.next); }
+//     };
+template <typename T>
+struct SharedPtrFields;
+
+struct CycleReport {
+    struct Member {
+        const void* object;
+        const char* type;
+        size_t use_count;
+    };
+
+    std::vector<Member> members;
+};
+
+// Registry of blocks created under a tracked policy. Each thread pushes onto
+// its own list with a CAS, so registration takes no lock; only the detector
+// unlinks entries, a list head with a CAS of its own. An entry holds a weak
+// reference, so a block whose object has died stays allocated until the next
+// detectCycles() drops its entry. A dead head whose unlink loses to a push
+// is dropped by the following run instead.
+template <typename Policy>
+class BlockTracker {
+    using Block = BaseControlBlock<Policy>;
+    using Edges = void (*)(const void*, std::vector<Block*>&);
+
+    struct Entry {
+        Block* cb;
+        const void* object;
+        const char* type;
+        Edges edges;
+        Entry* next;
+    };
+
+    struct ThreadList {
+        std::atomic<Entry*> head{nullptr};
+        ThreadList* next = nullptr;
+    };
+
+    static inline std::atomic<ThreadList*> lists{nullptr};
+    static inline std::mutex detect_mutex;
+
+    static ThreadList* addList() {
+        ThreadList* list = new ThreadList;
+        ThreadList* top = lists.load(std::memory_order_relaxed);
+        do {
+            list->next = top;
+        } while (!lists.compare_exchange_weak(top, list,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+        return list;
+    }
+
+    template <typename T>
+    static void edgesOf(const void* object, std::vector<Block*>& out) {
+        if constexpr (requires { sizeof(SharedPtrFields<T>); }) {
+            SharedPtrFields<T>::forEach(
+                *static_cast<const T*>(object), [&](const auto& field) {
+                    if constexpr (std::is_same_v<decltype(field.cb), Block*>) {
+                        if (field.cb != nullptr) {
+                            out.push_back(field.cb);
+                        }
+                    }
+                });
+        }
+    }
+
+  public:
+    template <typename T, bool IsArray>
+    static void add(Block* cb, const void* object) noexcept {
+        thread_local ThreadList* list = addList();
+        Edges edges = nullptr;
+        if constexpr (!IsArray) {
+            edges = &edgesOf<T>;
+        }
+        Entry* entry = new (std::nothrow)
+            Entry{cb, object, typeid(T).name(), edges,
+                  list->head.load(std::memory_order_relaxed)};
+        if (entry == nullptr) {
+            return;
+        }
+        cb->addWeak();
+        while (!list->head.compare_exchange_weak(entry->next, entry,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed)) {
+        }
+    }
+
+    // Reports the strongly connected components of tracked objects that are
+    // owned only from inside the graph. Pointer fields are read without
+    // synchronization, so the graph must not be mutated during the call.
+    static std::vector<CycleReport> detectCycles() {
+        std::lock_guard lock(detect_mutex);
+        std::vector<Entry*> nodes;
+        for (ThreadList* list = lists.load(std::memory_order_acquire);
+             list != nullptr; list = list->next) {
+            Entry* prev = nullptr;
+            Entry* entry = list->head.load(std::memory_order_acquire);
+            while (entry != nullptr) {
+                Entry* next = entry->next;
+                Entry* head = entry;
+                if (entry->cb->tryAddShared()) {
+                    nodes.push_back(entry);
+                    prev = entry;
+                } else if (prev != nullptr) {
+                    prev->next = next;
+                    entry->cb->releaseWeak();
+                    delete entry;
+                } else if (list->head.compare_exchange_strong(
+                               head, next, std::memory_order_acquire)) {
+                    entry->cb->releaseWeak();
+                    delete entry;
+                } else {
+                    prev = entry;
+                }
+                entry = next;
+            }
+        }
+
+        std::unordered_map<Block*, size_t> index;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            index.emplace(nodes[i]->cb, i);
+        }
+        std::vector<std::vector<size_t>> adjacent(nodes.size());
+        std::vector<size_t> internal(nodes.size(), 0);
+        std::vector<Block*> fields;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            fields.clear();
+            if (nodes[i]->edges != nullptr) {
+                nodes[i]->edges(nodes[i]->object, fields);
+            }
+            for (Block* field : fields) {
+                auto it = index.find(field);
+                if (it != index.end()) {
+                    adjacent[i].push_back(it->second);
+                    ++internal[it->second];
+                }
+            }
+        }
+
+        // Anything reachable from an object with an owner outside the graph
+        // (our own pin aside) is alive.
+        std::vector<bool> alive(nodes.size(), false);
+        std::vector<size_t> stack;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i]->cb->useCount() - 1 > internal[i]) {
+                alive[i] = true;
+                stack.push_back(i);
+            }
+        }
+        while (!stack.empty()) {
+            size_t node = stack.back();
+            stack.pop_back();
+            for (size_t next : adjacent[node]) {
+                if (!alive[next]) {
+                    alive[next] = true;
+                    stack.push_back(next);
+                }
+            }
+        }
+
+        // Iterative Tarjan over the dead part of the graph.
+        constexpr size_t kUnvisited = SIZE_MAX;
+        std::vector<size_t> order(nodes.size(), kUnvisited);
+        std::vector<size_t> low(nodes.size(), 0);
+        std::vector<bool> on_stack(nodes.size(), false);
+        std::vector<std::pair<size_t, size_t>> frames;
+        std::vector<CycleReport> reports;
+        size_t counter = 0;
+        for (size_t root = 0; root < nodes.size(); ++root) {
+            if (alive[root] || order[root] != kUnvisited) {
+                continue;
+            }
+            frames.push_back({root, 0});
+            while (!frames.empty()) {
+                auto& [node, edge] = frames.back();
+                if (edge == 0) {
+                    order[node] = low[node] = counter++;
+                    stack.push_back(node);
+                    on_stack[node] = true;
+                }
+                if (edge < adjacent[node].size()) {
+                    size_t next = adjacent[node][edge++];
+                    if (alive[next]) {
+                        continue;
+                    }
+                    if (order[next] == kUnvisited) {
+                        frames.push_back({next, 0});
+                    } else if (on_stack[next]) {
+                        low[node] = std::min(low[node], order[next]);
+                    }
+                    continue;
+                }
+                size_t done = node;
+                frames.pop_back();
+                if (!frames.empty()) {
+                    size_t parent = frames.back().first;
+                    low[parent] = std::min(low[parent], low[done]);
+                }
+                if (low[done] != order[done]) {
+                    continue;
+                }
+                CycleReport report;
+                size_t member;
+                do {
+                    member = stack.back();
+                    stack.pop_back();
+                    on_stack[member] = false;
+                    report.members.push_back({nodes[member]->object,
+                                              nodes[member]->type,
+                                              nodes[member]->cb->useCount() -
+                                                  1});
+                } while (member != done);
+                bool self_loop =
+                    std::find(adjacent[done].begin(), adjacent[done].end(),
+                              done) != adjacent[done].end();
+                if (report.members.size() > 1 || self_loop) {
+                    reports.push_back(std::move(report));
+                }
+            }
+        }
+
+        for (Entry* entry : nodes) {
+            entry->cb->releaseShared();
+        }
+        return reports;
+    }
+};
+
+template <typename Policy>
+std::vector<CycleReport> detectCycles() {
+    static_assert(Policy::kTracked);
+    return BlockTracker<Policy>::detectCycles();
+}
@@ -0,0 +1,157 @@
+// Counts the reference-count updates made by WeakPtr conversions and
+// assignments: rvalue paths steal the reference, and assignments from a
+// pointer into the block already held do no counter work. From the
+// repository root:
+//
+//   g++ -std=c++20 -I. tests/weak_ptr_counter_traffic.cpp -o counter_traffic
+//   ./counter_traffic
+//
+// It prints each failed check and exits non-zero if there was one.
+
+#include <cstddef>
+#include <cstdio>
+#include <type_traits>
+#include <utility>
+
+#include "smart_pointers.h"
+
+namespace {
+
+// Default counting, plus a tally of every update to a shared or weak count.
+struct CountingPolicy : SingleThreadedPolicy {
+    static inline size_t updates = 0;
+
+    static void increment(Counter& cnt) noexcept {
+        ++updates;
+        SingleThreadedPolicy::increment(cnt);
+    }
+
+    static void add(Counter& cnt, size_t n) noexcept {
+        ++updates;
+        SingleThreadedPolicy::add(cnt, n);
+    }
+
+    static bool decrement(Counter& cnt) noexcept {
+        ++updates;
+        return SingleThreadedPolicy::decrement(cnt);
+    }
+
+    static bool subtract(Counter& cnt, size_t n) noexcept {
+        ++updates;
+        return SingleThreadedPolicy::subtract(cnt, n);
+    }
+
+    static bool incrementIfNonZero(Counter& cnt) noexcept {
+        ++updates;
+        return SingleThreadedPolicy::incrementIfNonZero(cnt);
+    }
+};
+
+static_assert(SharedPtrPolicy<CountingPolicy>);
+
+struct Base {
+    int base = 1;
+};
+
+struct Derived : Base {
+    int derived = 2;
+};
+
+template <typename T>
+using Shared = SharedPtr<T, CountingPolicy>;
+
+template <typename T>
+using Weak = WeakPtr<T, CountingPolicy>;
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        std::printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Counter updates made by fn.
+template <typename F>
+size_t updatesIn(F&& fn) {
+    size_t before = CountingPolicy::updates;
+    std::forward<F>(fn)();
+    return CountingPolicy::updates - before;
+}
+
+// Every assignment returns a reference to the target.
+static_assert(std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                          std::declval<const Weak<Base>&>()),
+                             Weak<Base>&>);
+static_assert(std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                          std::declval<Weak<Base>>()),
+                             Weak<Base>&>);
+static_assert(std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                          std::declval<const Weak<Derived>&>()),
+                             Weak<Base>&>);
+static_assert(std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                          std::declval<Weak<Derived>>()),
+                             Weak<Base>&>);
+static_assert(
+    std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                std::declval<const Shared<Derived>&>()),
+                   Weak<Base>&>);
+static_assert(std::is_same_v<decltype(std::declval<Weak<Base>&>() =
+                                          std::declval<Shared<Derived>>()),
+                             Weak<Base>&>);
+
+void rvaluePathsSteal() {
+    Shared<Derived> owner = makeShared<Derived, CountingPolicy>();
+    Weak<Derived> source = owner;
+
+    Weak<Derived> moved;
+    check(updatesIn([&] { moved = Weak<Derived>(std::move(source)); }) == 0,
+          "WeakPtr(WeakPtr&&) and move assignment into an empty WeakPtr");
+    check(source.use_count() == 0 && moved.lock().get() == owner.get(),
+          "moved-from WeakPtr is empty");
+
+    Weak<Base> converted;
+    check(updatesIn([&] { converted = Weak<Base>(std::move(moved)); }) == 0,
+          "WeakPtr(WeakPtr<Derived>&&)");
+
+    Weak<Derived> again = owner;
+    Weak<Base> assigned;
+    check(updatesIn([&] { assigned = std::move(again); }) == 0,
+          "converting move assignment into an empty WeakPtr");
+    check(again.use_count() == 0 && assigned.lock().get() == owner.get(),
+          "converting move assignment keeps the object");
+}
+
+void sameBlockAssignmentsShortCircuit() {
+    Shared<Derived> owner = makeShared<Derived, CountingPolicy>();
+    Weak<Derived> weak = owner;
+    Weak<Derived> other = owner;
+    Weak<Base> base = owner;
+
+    check(updatesIn([&] { weak = other; }) == 0,
+          "copy assignment from the same block");
+    check(updatesIn([&] { base = other; }) == 0,
+          "converting copy assignment from the same block");
+    check(updatesIn([&] { base = owner; }) == 0,
+          "assignment from a SharedPtr to the same block");
+
+    // Moving a SharedPtr in only gives up its shared reference.
+    Shared<Derived> extra = owner;
+    check(updatesIn([&] { base = std::move(extra); }) == 1,
+          "move assignment from a SharedPtr to the same block");
+    check(owner.use_count() == 1 && base.lock().get() == owner.get(),
+          "move assignment from a SharedPtr keeps the object");
+}
+
+}  // namespace
+
+int main() {
+    rvaluePathsSteal();
+    sameBlockAssignmentsShortCircuit();
+    if (failures != 0) {
+        return 1;
+    }
+    std::printf("ok\n");
+    return 0;
+}